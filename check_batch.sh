@@ -0,0 +1,59 @@
+#!/bin/bash
+# Batch mode against a live otp_enc_d when the daemon refuses one file:
+# that file is reported and skipped, the files before it are finished
+# with their newline, and the files after it are still encrypted.
+# Run from the build directory, as ./compileall check does.
+
+dir=$(mktemp -d)
+daemon=0
+cleanup()
+{
+	[ "$daemon" -gt 0 ] && kill -INT "$daemon" 2>/dev/null && wait "$daemon" 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "check_batch: FAIL: $1"
+	exit 1
+}
+
+# pad "small" holds 100 symbols, so from offset 95 it is too short for an 11 symbol text
+mkdir "$dir/pads"
+./keygen 100 > "$dir/pads/small"
+for n in 1 2 3 4 5; do
+	echo "HELLO WORLD" > "$dir/t$n"
+	./keygen 11 > "$dir/t$n.key"
+done
+
+./otp_enc_d -p "$dir/pads" "unix:$dir/enc.sock" &
+daemon=$!
+for i in $(seq 50); do
+	[ -S "$dir/enc.sock" ] && break
+	sleep 0.1
+done
+[ -S "$dir/enc.sock" ] || fail "otp_enc_d did not start"
+
+# refused files in the middle and at the end of one pipelined group
+for n in 1 2 3 4 5; do
+	case $n in
+		2|5) echo "$dir/t$n pad:small:95 $dir/o$n" ;;
+		*) echo "$dir/t$n $dir/t$n.key $dir/o$n" ;;
+	esac
+done > "$dir/manifest"
+
+./otp_enc -f "$dir/manifest" "unix:$dir/enc.sock" 2> "$dir/stderr"
+status=$?
+
+[ "$status" -eq 1 ] || fail "exit status $status, expected 1"
+grep -qx "$dir/t2: Key length is too short." "$dir/stderr" || fail "t2 not reported: $(cat "$dir/stderr")"
+grep -qx "$dir/t5: Key length is too short." "$dir/stderr" || fail "t5 not reported: $(cat "$dir/stderr")"
+[ ! -e "$dir/o2" ] && [ ! -e "$dir/o5" ] || fail "output of a refused file was left behind"
+
+for n in 1 3 4; do
+	[ "$(stat -c %s "$dir/o$n")" -eq 12 ] || fail "o$n is $(stat -c %s "$dir/o$n") bytes, expected 12"
+	./otp_dec --offline "$dir/o$n" "$dir/t$n.key" | cmp -s - "$dir/t$n" || fail "o$n does not decrypt to t$n"
+done
+
+echo "check_batch: ok"
@@ -0,0 +1,84 @@
+#!/bin/bash
+# Messages of 256 MiB and 1 GiB round tripped through otp_enc_d and
+# otp_dec_d: each result must match byte for byte, and the time per byte
+# at 1 GiB may be at most CHECK_SCALE_TOLERANCE percent (default 25) above
+# the time per byte at 256 MiB, so cost stays linear in message size.
+# Each size is timed CHECK_SCALE_RUNS times (default 3) and the best run
+# counts. Disk writeback is flushed between the timed steps rather than
+# timed, and the decrypted result goes straight to cmp instead of to a
+# file. Needs about 3 GiB free under TMPDIR. Run from the build
+# directory, as ./compileall scale does.
+
+tolerance=${CHECK_SCALE_TOLERANCE:-25}
+runs=${CHECK_SCALE_RUNS:-3}
+dir=$(mktemp -d)
+encDaemon=0
+decDaemon=0
+cleanup()
+{
+	[ "$encDaemon" -gt 0 ] && kill -INT "$encDaemon" 2>/dev/null && wait "$encDaemon" 2>/dev/null
+	[ "$decDaemon" -gt 0 ] && kill -INT "$decDaemon" 2>/dev/null && wait "$decDaemon" 2>/dev/null
+	rm -rf "$dir"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "check_scale: FAIL: $1" >&2
+	exit 1
+}
+
+waitFor()
+{
+	for i in $(seq 50); do
+		[ -S "$1" ] && return 0
+		sleep 0.1
+	done
+	fail "daemon at $1 did not start"
+}
+
+./otp_enc_d "unix:$dir/enc.sock" &
+encDaemon=$!
+./otp_dec_d "unix:$dir/dec.sock" &
+decDaemon=$!
+waitFor "$dir/enc.sock"
+waitFor "$dir/dec.sock"
+
+# Round trips a message of $1 symbols $runs times, checking every result,
+# and prints the best time in picoseconds per symbol
+roundTrip()
+{
+	local size=$1 best=0 run
+	./keygen -j 4 "$size" > "$dir/text" || fail "keygen failed"
+	./keygen -j 4 "$size" > "$dir/key" || fail "keygen failed"
+
+	for run in $(seq "$runs"); do
+		rm -f "$dir/cipher"
+		sync
+		local start=$(date +%s%N)
+		./otp_enc -o "$dir/cipher" "$dir/text" "$dir/key" "unix:$dir/enc.sock" || fail "otp_enc failed at $size bytes"
+		local encrypted=$(date +%s%N)
+		sync
+		local decrypting=$(date +%s%N)
+		set -o pipefail
+		./otp_dec "$dir/cipher" "$dir/key" "unix:$dir/dec.sock" | cmp -s - "$dir/text" || fail "round trip of $size bytes does not match"
+		set +o pipefail
+		local end=$(date +%s%N)
+
+		cmp -s "$dir/text" "$dir/cipher" && fail "ciphertext of $size bytes is the text"
+		local ps=$(( (encrypted - start + end - decrypting) * 1000 / size ))
+		[ "$best" -eq 0 ] || [ "$ps" -lt "$best" ] && best=$ps
+	done
+
+	rm -f "$dir/text" "$dir/key" "$dir/cipher"
+	echo "$best"
+}
+
+small=$((256 * 1024 * 1024))
+large=$((1024 * 1024 * 1024))
+smallPs=$(roundTrip $small) || exit 1
+largePs=$(roundTrip $large) || exit 1
+
+echo "check_scale: 256 MiB at $smallPs ps/byte, 1 GiB at $largePs ps/byte (tolerance $tolerance%)"
+[ $((largePs * 100)) -le $((smallPs * (100 + tolerance))) ] || fail "time per byte grew by more than $tolerance% from 256 MiB to 1 GiB"
+echo "check_scale: ok"
@@ -1,46 +1,294 @@
-#include <time.h>
-#include <stdlib.h>
-#include <stdio.h>
-#include <unistd.h> 
-
-int main(int argc, char *argv[])
-{
-	// ensure valid args are provided
-	if(argc != 2)
-	{
-		fprintf(stderr,"USAGE: %s length\n", argv[0]); 
-		exit(1);
-	}
-		
-	// convert to int
-	int keylength = atoi(argv[1]);
-	
-	//seed random generator
-	srand(time(NULL));
-	
-	// loop to generate 'keylength' random characters
-	int i;
-	for(i = 0; i < keylength; i++)
-	{
-		char tmpChar;
-		
-		// get int from 0-26
-		int tmpInt = rand() % 27;
-		
-		// if 0, set to space (ascii 32)
-		if(tmpInt == 0)
-			tmpChar =(char)  32;
-		else
-		{
-			// conver value to capital letter ASCII by adding 64
-			tmpChar = (char) tmpInt + 64;
-		}
-		//write out
-		write(STDOUT_FILENO, &tmpChar, 1);
-	}
-	// add newline
-	char newline = '\n';
-	write(STDOUT_FILENO, &newline, 1);
-	
-	return 0;
-}
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/random.h>
+#include "otp_codec.h"
+
+// symbols each thread produces per round, and the most threads allowed
+#define KEYGEN_BLOCK (1024 * 1024)
+#define KEYGEN_MAX_THREADS 256
+
+// ChaCha20 blocks generated side by side, one per vector lane
+#define KEYGEN_LANES 8
+
+// 27 * 9: bytes below this map to a symbol without bias, the rest are redrawn
+#define KEYGEN_ACCEPT 243
+
+// one generator thread: its own ChaCha20 stream and two output blocks,
+// one being filled while the main thread writes the other
+struct keygenWorker
+{
+	uint32_t state[16];
+	char* block[2];
+	size_t length[2];		// symbols wanted in each block
+	int which;				// block being filled this round
+	pthread_t thread;
+};
+
+// forward declarations
+static void seedWorker(struct keygenWorker* worker);
+static void chachaBlocks(uint32_t out[KEYGEN_LANES][16], uint32_t state[16]);
+static void* fillBlock(void* arg);
+static void writeAll(const char* data, size_t length);
+
+// symbol for each random byte, with bytes at or above KEYGEN_ACCEPT rejected
+static char symbolFor[256];
+
+// -x: a binary pad, the ChaCha20 stream itself, for otp_enc / otp_dec -x
+static int binary = 0;
+
+int main(int argc, char *argv[])
+{
+	int threads = 1;
+	int opt;
+
+	while((opt = getopt(argc, argv, "j:x")) != -1)
+	{
+		switch(opt)
+		{
+			case 'j': // generator threads
+				threads = atoi(optarg);
+				if(threads < 1 || threads > KEYGEN_MAX_THREADS)
+				{
+					fprintf(stderr,"Thread count must be between 1 and %d.\n", KEYGEN_MAX_THREADS);
+					exit(1);
+				}
+				break;
+			case 'x': // raw bytes, no newline
+				binary = 1;
+				break;
+			default:
+				fprintf(stderr,"USAGE: %s [-j threads] [-x] length\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	// ensure valid args are provided
+	if(optind != argc - 1)
+	{
+		fprintf(stderr,"USAGE: %s [-j threads] [-x] length\n", argv[0]);
+		exit(1);
+	}
+
+	// convert to a 64 bit count, keys can be larger than an int
+	unsigned long long keylength = strtoull(argv[optind], NULL, 10);
+
+	// byte b < 243 becomes symbol b % 27, which leaves each symbol 9 bytes
+	int b;
+	for(b = 0; b < KEYGEN_ACCEPT; b++)
+		symbolFor[b] = otpSymbolChar[b % 27];
+
+	struct keygenWorker* workers = calloc(threads, sizeof(struct keygenWorker));
+	if(workers == NULL)
+	{
+		fprintf(stderr,"Unable to allocate generators.\n");
+		exit(1);
+	}
+	int i;
+	for(i = 0; i < threads; i++)
+	{
+		seedWorker(&workers[i]);
+		workers[i].block[0] = malloc(KEYGEN_BLOCK);
+		workers[i].block[1] = malloc(KEYGEN_BLOCK);
+		if(workers[i].block[0] == NULL || workers[i].block[1] == NULL)
+		{
+			fprintf(stderr,"Unable to allocate output blocks.\n");
+			exit(1);
+		}
+	}
+
+	// each round every thread fills one block; while the next round is
+	// being generated the previous one is written out in order
+	unsigned long long remaining = keylength;
+	int round = 0, previous = 0;
+	while(remaining > 0 || previous > 0)
+	{
+		int which = round & 1;
+		int current = 0;
+		for(i = 0; i < threads && remaining > 0; i++, current++)
+		{
+			workers[i].which = which;
+			workers[i].length[which] = (remaining < KEYGEN_BLOCK) ? remaining : KEYGEN_BLOCK;
+			remaining -= workers[i].length[which];
+			if(pthread_create(&workers[i].thread, NULL, fillBlock, &workers[i]) != 0)
+			{
+				fprintf(stderr,"Unable to start generator thread.\n");
+				exit(1);
+			}
+		}
+
+		// write the round before this one while the threads work
+		for(i = 0; i < previous; i++)
+			writeAll(workers[i].block[which ^ 1], workers[i].length[which ^ 1]);
+
+		for(i = 0; i < current; i++)
+			pthread_join(workers[i].thread, NULL);
+		previous = current;
+		round++;
+	}
+
+	// add newline, a binary pad is exactly length bytes
+	if(!binary)
+		writeAll("\n", 1);
+
+	for(i = 0; i < threads; i++)
+	{
+		free(workers[i].block[0]);
+		free(workers[i].block[1]);
+	}
+	free(workers);
+	return 0;
+}
+
+// Gives a worker its own ChaCha20 key, straight from the kernel's CSPRNG
+static void seedWorker(struct keygenWorker* worker)
+{
+	// "expand 32-byte k"
+	worker->state[0] = 0x61707865;
+	worker->state[1] = 0x3320646e;
+	worker->state[2] = 0x79622d32;
+	worker->state[3] = 0x6b206574;
+
+	char* key = (char*)&worker->state[4];
+	size_t got = 0;
+	while(got < 32)
+	{
+		ssize_t n = getrandom(key + got, 32 - got, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0)
+		{
+			perror("getrandom");
+			exit(1);
+		}
+		got += n;
+	}
+
+	// 64 bit block counter, zero nonce: the key is never reused
+	worker->state[12] = worker->state[13] = 0;
+	worker->state[14] = worker->state[15] = 0;
+}
+
+// KEYGEN_LANES 32 bit lanes; GCC / clang vector extensions turn every
+// operation on these into a couple of SSE2 (or one wider) instructions
+typedef uint32_t lanes __attribute__((vector_size(4 * KEYGEN_LANES)));
+
+#define ROTATE(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+#define QUARTER(a, b, c, d) \
+	a += b; d ^= a; d = ROTATE(d, 16); \
+	c += d; b ^= c; b = ROTATE(b, 12); \
+	a += b; d ^= a; d = ROTATE(d, 8); \
+	c += d; b ^= c; b = ROTATE(b, 7);
+
+// Produces the next KEYGEN_LANES blocks (64 bytes each) of the ChaCha20
+// stream, one block per lane, and advances the counter past them
+static void chachaBlocks(uint32_t out[KEYGEN_LANES][16], uint32_t state[16])
+{
+	lanes input[16], x[16];
+	int i, l;
+
+	// every lane holds the same state except for its block counter
+	for(i = 0; i < 16; i++)
+	{
+		for(l = 0; l < KEYGEN_LANES; l++)
+			input[i][l] = state[i];
+	}
+	for(l = 0; l < KEYGEN_LANES; l++)
+	{
+		uint64_t counter = (((uint64_t)state[13] << 32) | state[12]) + l;
+		input[12][l] = (uint32_t)counter;
+		input[13][l] = (uint32_t)(counter >> 32);
+	}
+
+	memcpy(x, input, sizeof(x));
+	for(i = 0; i < 10; i++)
+	{
+		QUARTER(x[0], x[4], x[8], x[12]);
+		QUARTER(x[1], x[5], x[9], x[13]);
+		QUARTER(x[2], x[6], x[10], x[14]);
+		QUARTER(x[3], x[7], x[11], x[15]);
+		QUARTER(x[0], x[5], x[10], x[15]);
+		QUARTER(x[1], x[6], x[11], x[12]);
+		QUARTER(x[2], x[7], x[8], x[13]);
+		QUARTER(x[3], x[4], x[9], x[14]);
+	}
+	for(i = 0; i < 16; i++)
+	{
+		x[i] += input[i];
+		for(l = 0; l < KEYGEN_LANES; l++)
+			out[l][i] = x[i][l];
+	}
+
+	uint64_t next = (((uint64_t)state[13] << 32) | state[12]) + KEYGEN_LANES;
+	state[12] = (uint32_t)next;
+	state[13] = (uint32_t)(next >> 32);
+}
+
+// Thread body: fills the worker's current block
+static void* fillBlock(void* arg)
+{
+	struct keygenWorker* worker = arg;
+	char* out = worker->block[worker->which];
+	size_t length = worker->length[worker->which];
+	size_t filled = 0;
+	uint32_t words[KEYGEN_LANES][16];
+	const size_t batch = sizeof(words);
+
+	while(filled < length)
+	{
+		chachaBlocks(words, worker->state);
+		const unsigned char* bytes = (const unsigned char*)words;
+
+		// every byte of the stream is a binary pad byte, nothing is redrawn
+		if(binary)
+		{
+			size_t take = (length - filled < batch) ? length - filled : batch;
+			memcpy(out + filled, bytes, take);
+			filled += take;
+			continue;
+		}
+
+		// branch free rejection: always store, only advance on an accepted
+		// byte; the last batch's unused bytes are simply dropped
+		size_t k;
+		if(length - filled >= batch)
+		{
+			for(k = 0; k < batch; k++)
+			{
+				out[filled] = symbolFor[bytes[k]];
+				filled += (bytes[k] < KEYGEN_ACCEPT);
+			}
+		}
+		else
+		{
+			for(k = 0; k < batch && filled < length; k++)
+			{
+				out[filled] = symbolFor[bytes[k]];
+				filled += (bytes[k] < KEYGEN_ACCEPT);
+			}
+		}
+	}
+	return NULL;
+}
+
+// Writes every byte to stdout, retrying partial writes
+static void writeAll(const char* data, size_t length)
+{
+	while(length > 0)
+	{
+		ssize_t written = write(STDOUT_FILENO, data, length);
+		if(written < 0 && errno == EINTR)
+			continue;
+		if(written < 0)
+		{
+			perror("keygen: write");
+			exit(1);
+		}
+		data += written;
+		length -= written;
+	}
+}
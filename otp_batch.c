@@ -0,0 +1,474 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include "otp_batch.h"
+
+// where a share of the jobs goes: the daemon, or context when it is set
+struct batchTarget
+{
+	const char* address;
+	int handshakeId;
+	const char* deniedMessage;
+	struct otpContext* context;
+};
+
+// forward declarations
+static int runShares(const struct otpBatch* batch, int processes, const struct batchTarget* target);
+static int runTarget(const struct otpBatch* batch, size_t first, size_t step, const struct batchTarget* target);
+static int loadManifest(struct otpBatch* batch, const char* path);
+static int loadDirectory(struct otpBatch* batch, const char* path);
+static int addJob(struct otpBatch* batch, size_t* capacity, char* text, char* key, char* output);
+static char* joinPath(const char* directory, const char* name, const char* suffix);
+static int hasSuffix(const char* name, const char* suffix);
+static int compareJobs(const void* a, const void* b);
+static int runShare(const struct otpBatch* batch, size_t first, size_t step, const char* address, int handshakeId, const char* deniedMessage);
+static int runLocalShare(const struct otpBatch* batch, size_t first, size_t step, struct otpContext* context);
+static int openShare(const struct otpBatch* batch, const char* address, int handshakeId, const char* deniedMessage);
+static int openJob(const struct otpBatchJob* job, struct otpInput* text, struct otpInput* key, struct otpRequest* request, int binary);
+static int finishOutput(const char* path, int fd, int binary);
+
+int otpBatchLoad(struct otpBatch* batch, const char* source)
+{
+	struct stat info;
+
+	batch->jobs = NULL;
+	batch->count = 0;
+	batch->binary = 0;
+
+	if(strcmp(source, "-") != 0 && stat(source, &info) == 0 && S_ISDIR(info.st_mode))
+		return loadDirectory(batch, source);
+	return loadManifest(batch, source);
+}
+
+int otpBatchRun(const struct otpBatch* batch, const char* address, int handshakeId, int connections, const char* deniedMessage)
+{
+	struct batchTarget target = { address, handshakeId, deniedMessage, NULL };
+	return runShares(batch, connections, &target);
+}
+
+int otpBatchRunLocal(const struct otpBatch* batch, struct otpContext* context, int processes)
+{
+	struct batchTarget target = { 0, 0, NULL, context };
+	return runShares(batch, processes, &target);
+}
+
+void otpBatchFree(struct otpBatch* batch)
+{
+	size_t i;
+	for(i = 0; i < batch->count; i++)
+	{
+		free(batch->jobs[i].text);
+		free(batch->jobs[i].key);
+		free(batch->jobs[i].output);
+	}
+	free(batch->jobs);
+	batch->jobs = NULL;
+	batch->count = 0;
+}
+
+// Splits the jobs over up to processes processes (or runs them here, for
+// one) and returns how many of them failed
+static int runShares(const struct otpBatch* batch, int processes, const struct batchTarget* target)
+{
+	if(batch->count == 0)
+		return 0;
+	if(processes < 1)
+		processes = 1;
+	if((size_t)processes > batch->count)
+		processes = batch->count;
+
+	// one process needs no helpers
+	if(processes == 1)
+		return runTarget(batch, 0, 1, target) > 0;
+
+	// otherwise each process (and its connection) takes every processes-th
+	// job; any failure of one (even an exit from deep in the client) is
+	// only that process's
+	fflush(stdout);
+	fflush(stderr);
+	int c, failed = 0;
+	for(c = 0; c < processes; c++)
+	{
+		pid_t pid = fork();
+		if(pid < 0)
+		{
+			perror("fork");
+			failed++;
+			break;
+		}
+		if(pid == 0)
+			exit(runTarget(batch, c, processes, target) > 0);
+	}
+
+	int status;
+	while(wait(&status) > 0)
+	{
+		if(!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed++;
+	}
+	return failed;
+}
+
+// Runs one share against the target, returns how many files were skipped
+static int runTarget(const struct otpBatch* batch, size_t first, size_t step, const struct batchTarget* target)
+{
+	if(target->context != NULL)
+		return runLocalShare(batch, first, step, target->context);
+	return runShare(batch, first, step, target->address, target->handshakeId, target->deniedMessage);
+}
+
+// Reads "text key output" lines from the manifest at path ("-" for stdin)
+static int loadManifest(struct otpBatch* batch, const char* path)
+{
+	FILE* manifest = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	if(manifest == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	char* line = NULL;
+	size_t lineSize = 0, capacity = 0, lineNumber = 0;
+	int status = 0;
+	while(getline(&line, &lineSize, manifest) != -1)
+	{
+		lineNumber++;
+
+		char* save;
+		char* fields[4];
+		int f;
+		for(f = 0; f < 4; f++)
+			fields[f] = strtok_r((f == 0) ? line : NULL, " \t\r\n", &save);
+
+		// blank lines and comments
+		if(fields[0] == NULL || fields[0][0] == '#')
+			continue;
+		if(fields[2] == NULL || fields[3] != NULL)
+		{
+			fprintf(stderr,"%s:%zu: expected <text> <key> <output>\n", path, lineNumber);
+			status = -1;
+			break;
+		}
+
+		if(addJob(batch, &capacity, strdup(fields[0]), strdup(fields[1]), strdup(fields[2])) < 0)
+		{
+			status = -1;
+			break;
+		}
+	}
+	if(status == 0 && ferror(manifest))
+	{
+		perror(path);
+		status = -1;
+	}
+
+	free(line);
+	if(manifest != stdin)
+		fclose(manifest);
+	if(status < 0)
+		otpBatchFree(batch);
+	return status;
+}
+
+// Pairs every file NAME in the directory at path with NAME.key, if there is one
+static int loadDirectory(struct otpBatch* batch, const char* path)
+{
+	DIR* dir = opendir(path);
+	if(dir == NULL)
+	{
+		perror(path);
+		return -1;
+	}
+
+	size_t capacity = 0;
+	struct dirent* entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		const char* name = entry->d_name;
+		struct stat info;
+
+		// keys and earlier results are never texts themselves
+		if(name[0] == '.' || hasSuffix(name, ".key") || hasSuffix(name, ".out"))
+			continue;
+		if(fstatat(dirfd(dir), name, &info, 0) < 0 || !S_ISREG(info.st_mode))
+			continue;
+
+		char* key = joinPath(path, name, ".key");
+		if(key != NULL && (stat(key, &info) < 0 || !S_ISREG(info.st_mode)))
+		{
+			free(key);
+			continue;
+		}
+
+		if(addJob(batch, &capacity, joinPath(path, name, ""), key, joinPath(path, name, ".out")) < 0)
+		{
+			closedir(dir);
+			otpBatchFree(batch);
+			return -1;
+		}
+	}
+	closedir(dir);
+
+	// readdir order is arbitrary; runs over the same directory should match
+	if(batch->count > 0)
+		qsort(batch->jobs, batch->count, sizeof(struct otpBatchJob), compareJobs);
+	return 0;
+}
+
+// Appends a job taking ownership of the three strings (any of which may be
+// a failed allocation) and parses a pad reference in key
+static int addJob(struct otpBatch* batch, size_t* capacity, char* text, char* key, char* output)
+{
+	if(text == NULL || key == NULL || output == NULL)
+		goto failed;
+
+	if(batch->count == *capacity)
+	{
+		size_t grownCapacity = (*capacity > 0) ? *capacity * 2 : 64;
+		struct otpBatchJob* grown = realloc(batch->jobs, grownCapacity * sizeof(struct otpBatchJob));
+		if(grown == NULL)
+			goto failed;
+		batch->jobs = grown;
+		*capacity = grownCapacity;
+	}
+
+	struct otpBatchJob* job = &batch->jobs[batch->count++];
+	memset(job, 0, sizeof(*job));
+	job->text = text;
+	job->key = key;
+	job->output = output;
+	otpParsePadReference(job->key, &job->request);
+	return 0;
+
+failed:
+	fprintf(stderr,"Unable to allocate batch.\n");
+	free(text);
+	free(key);
+	free(output);
+	return -1;
+}
+
+// directory/name + suffix in a new string, NULL if out of memory
+static char* joinPath(const char* directory, const char* name, const char* suffix)
+{
+	size_t length = strlen(directory) + strlen(name) + strlen(suffix) + 2;
+	char* path = malloc(length);
+	if(path != NULL)
+		snprintf(path, length, "%s/%s%s", directory, name, suffix);
+	return path;
+}
+
+static int hasSuffix(const char* name, const char* suffix)
+{
+	size_t nameLength = strlen(name), suffixLength = strlen(suffix);
+	return nameLength > suffixLength && strcmp(name + nameLength - suffixLength, suffix) == 0;
+}
+
+static int compareJobs(const void* a, const void* b)
+{
+	return strcmp(((const struct otpBatchJob*)a)->text, ((const struct otpBatchJob*)b)->text);
+}
+
+// Runs jobs first, first + step, ... over one connection, a group of
+// them per pipeline. Returns how many files were skipped
+static int runShare(const struct otpBatch* batch, size_t first, size_t step, const char* address, int handshakeId, const char* deniedMessage)
+{
+	struct otpRequest requests[OTP_BATCH_GROUP];
+	struct otpInput texts[OTP_BATCH_GROUP], keys[OTP_BATCH_GROUP];
+	const struct otpBatchJob* groupJobs[OTP_BATCH_GROUP];
+	int skipped = 0;
+	int socketFD = -1;
+
+	size_t next = first;
+	while(next < batch->count)
+	{
+		// map the next group; its inputs stay mapped until it is answered
+		size_t n = 0;
+		uint64_t bytes = 0;
+		while(next < batch->count && n < OTP_BATCH_GROUP && bytes < OTP_BATCH_GROUP_BYTES)
+		{
+			const struct otpBatchJob* job = &batch->jobs[next];
+			next += step;
+			if(!openJob(job, &texts[n], &keys[n], &requests[n], batch->binary))
+			{
+				skipped++;
+				continue;
+			}
+			bytes += requests[n].length;
+			groupJobs[n++] = job;
+		}
+
+		// the results are written as they arrive; a request the daemon
+		// refuses ends the connection, so the rest go again on a new one
+		size_t done = 0;
+		while(done < n)
+		{
+			if(socketFD < 0)
+				socketFD = openShare(batch, address, handshakeId, deniedMessage);
+
+			char message[OTP_ERROR_MAX];
+			size_t answered = done + otpPipeline(socketFD, requests + done, n - done, message, sizeof(message));
+			for(; done < answered; done++)
+			{
+				if(!finishOutput(groupJobs[done]->output, requests[done].outFD, batch->binary))
+					skipped++;
+			}
+			if(done == n)
+				break;
+
+			// the refused file's output holds at most part of a result
+			fprintf(stderr,"%s: %s\n", groupJobs[done]->text, message);
+			close(requests[done].outFD);
+			unlink(groupJobs[done]->output);
+			skipped++;
+			done++;
+			close(socketFD);
+			socketFD = -1;
+		}
+
+		size_t i;
+		for(i = 0; i < n; i++)
+		{
+			otpUnmapInput(&texts[i]);
+			otpUnmapInput(&keys[i]);
+		}
+	}
+
+	if(socketFD >= 0)
+		close(socketFD);
+	return skipped;
+}
+
+// Runs jobs first, first + step, ... in this process with context
+// returns how many files were skipped
+static int runLocalShare(const struct otpBatch* batch, size_t first, size_t step, struct otpContext* context)
+{
+	int skipped = 0;
+	size_t next;
+	for(next = first; next < batch->count; next += step)
+	{
+		const struct otpBatchJob* job = &batch->jobs[next];
+		if(job->request.pad != NULL)
+		{
+			fprintf(stderr,"%s: pads are held by the daemon, name the pad file instead.\n", job->text);
+			skipped++;
+			continue;
+		}
+
+		int textFD = open(job->text, O_RDONLY);
+		if(textFD < 0)
+		{
+			perror(job->text);
+			skipped++;
+			continue;
+		}
+		int keyFD = open(job->key, O_RDONLY);
+		if(keyFD < 0)
+		{
+			perror(job->key);
+			close(textFD);
+			skipped++;
+			continue;
+		}
+
+		// read and write, so the result can be written through a mapping
+		int outFD = open(job->output, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		int status = (outFD < 0) ? -1 : otpContextRunFD(context, outFD, textFD, keyFD);
+		if(outFD >= 0 && close(outFD) < 0 && status == 0)
+			status = -1;
+
+		if(status == -1)
+			perror(job->output);
+		else if(status == OTP_LOCAL_INVALID_TEXT)
+			fprintf(stderr,"%s: Invalid character detected at byte %lld.\n", job->text, context->invalid);
+		else if(status == OTP_LOCAL_INVALID_KEY)
+			fprintf(stderr,"%s: Invalid character detected at byte %lld.\n", job->key, context->invalid);
+		else if(status == OTP_LOCAL_SHORT_KEY)
+			fprintf(stderr,"%s: Key length is too short.\n", job->key);
+		if(status != 0)
+			skipped++;
+
+		close(textFD);
+		close(keyFD);
+	}
+	return skipped;
+}
+
+// Connects to the daemon and performs the handshake, exiting with
+// deniedMessage if it refuses this client; returns the socket
+static int openShare(const struct otpBatch* batch, const char* address, int handshakeId, const char* deniedMessage)
+{
+	int socketFD = otpOpen(address, handshakeId, batch->binary ? OTP_HELLO_BINARY : 0);
+	if(socketFD < 0)
+	{
+		fprintf(stderr,"%s\n", deniedMessage);
+		exit(1);
+	}
+	return socketFD;
+}
+
+// Maps and checks one job's text and key into request, and opens its output
+// returns 1, or 0 after reporting why the job is skipped
+static int openJob(const struct otpBatchJob* job, struct otpInput* text, struct otpInput* key, struct otpRequest* request, int binary)
+{
+	*request = job->request;
+	if(binary && request->pad != NULL)
+	{
+		fprintf(stderr,"%s: pads cannot be used in binary mode.\n", job->text);
+		return 0;
+	}
+
+	// pads are checked by the daemon
+	int keyStatus;
+	int textStatus = otpMapInputs(job->text, text, (request->pad == NULL) ? job->key : NULL, key, &keyStatus, binary);
+	if(textStatus == -1)
+	{
+		perror(job->text);
+		return 0;
+	}
+
+	if(textStatus == -3)
+		fprintf(stderr,"%s: Invalid character detected at byte %lld.\n", job->text, (long long)text->invalid);
+	else if(keyStatus == -1)
+		perror(job->key);
+	else if(keyStatus == -3)
+		fprintf(stderr,"%s: Invalid character detected at byte %lld.\n", job->key, (long long)key->invalid);
+	else if(request->pad == NULL && text->length > key->length)
+		fprintf(stderr,"%s: Key length is too short.\n", job->key);
+	else if((request->outFD = open(job->output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+		perror(job->output);
+	else
+	{
+		// the result and its newline are written here as they arrive
+		otpReserveOutput(request->outFD, text->length + !binary);
+		request->text = text->data;
+		request->key = key->data;
+		request->length = text->length;
+		request->result = NULL;
+		return 1;
+	}
+
+	otpUnmapInput(key);
+	otpUnmapInput(text);
+	return 0;
+}
+
+// Ends a result written to fd with its newline, as otp_enc / otp_dec
+// print it (binary results have none), and closes it. Returns 1, or 0
+// after reporting the error
+static int finishOutput(const char* path, int fd, int binary)
+{
+	int written = binary || (write(fd, "\n", 1) == 1);
+	if(close(fd) < 0)
+		written = 0;
+	if(!written)
+		perror(path);
+	return written;
+}
@@ -0,0 +1,59 @@
+#ifndef OTP_BATCH_H
+#define OTP_BATCH_H
+
+#include <stddef.h>
+#include "otp_client.h"
+#include "otp_local.h"
+
+// Batch mode for otp_enc and otp_dec (libotp): many (text, key, output)
+// triples handled by one process over a few persistent connections, so
+// a pipeline with thousands of files pays for startup, the host lookup,
+// connect and handshake once per connection instead of once per file.
+
+// requests sent per otpPipeline call, and the bytes of text they may
+// hold between them (a single larger file still goes alone); the inputs
+// of a whole group stay mapped until it has been answered
+#define OTP_BATCH_GROUP 64
+#define OTP_BATCH_GROUP_BYTES (64 * 1024 * 1024)
+
+// one triple; key may be a pad reference, already parsed into request
+struct otpBatchJob
+{
+	char* text;
+	char* key;
+	char* output;
+	struct otpRequest request;
+};
+
+struct otpBatch
+{
+	struct otpBatchJob* jobs;
+	size_t count;
+	int binary;				// raw bytes and XOR (OTP_HELLO_BINARY), set by the caller after loading
+};
+
+// Loads the triples from source, either a manifest (one "text key output"
+// line each, blank lines and lines starting with '#' are skipped, "-" reads
+// standard input) or a directory, where every file NAME with a NAME.key
+// beside it is a text and its result goes to NAME.out. Returns 0, or -1
+// after printing what was wrong with source
+int otpBatchLoad(struct otpBatch* batch, const char* source);
+
+// Runs every job against the daemon at address (as otpConnect takes it) over up to connections
+// parallel connections (one process each), writing each result and a
+// newline (none in binary mode) to its output file. A file that cannot be read, holds invalid
+// characters or has too short a key is reported and skipped, whether the
+// daemon found it (the rest then go again on a new connection, as the
+// daemon ends the old one) or this process did; deniedMessage
+// is printed if the daemon refuses handshakeId. Returns the number of
+// connections that failed or skipped a file, 0 if every file was written
+int otpBatchRun(const struct otpBatch* batch, const char* address, int handshakeId, int connections, const char* deniedMessage);
+
+// The same without a daemon: every job is transformed with context, by
+// up to processes processes. Pad references are reported and skipped
+int otpBatchRunLocal(const struct otpBatch* batch, struct otpContext* context, int processes);
+
+// Frees what otpBatchLoad allocated
+void otpBatchFree(struct otpBatch* batch);
+
+#endif
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include "otp_codec.h"
+#include "otp_conn.h"
+#include "otp_client.h"
+
+// Microbenchmarks for the per byte hot paths of libotp, printed as JSON.
+// Every benchmark runs over message sizes from 64 bytes up to the -m
+// limit; each size is timed -r times and the fastest run is reported.
+
+// sizes grow by this factor, starting at 64 bytes
+#define BENCH_MIN_SIZE 64
+#define BENCH_SIZE_STEP 16
+
+// a timed run repeats the body until it takes at least this long
+#define BENCH_MIN_RUN_NS 50000000ULL
+
+// the legacy path holds text, key and result whole, so it stops here
+#define BENCH_LEGACY_MAX (256 * 1024 * 1024)
+
+// one benchmark: a name and a body that processes n bytes once
+struct benchCase
+{
+	const char* name;
+	void (*body)(size_t n);
+	size_t maxSize;			// 0 for no limit of its own
+	void (*prepare)(size_t n);	// optional, run once per size before timing
+};
+
+// forward declarations
+static void benchEncode(size_t n);
+static void benchDecode(size_t n);
+static void benchValidate(size_t n);
+static void benchXor(size_t n);
+static void prepareInputFile(size_t n);
+static void benchMapInput(size_t n);
+static void benchLegacyReceive(size_t n);
+static void benchStreamReceive(size_t n);
+static void feedConnection(const char* data, size_t length);
+static void runCase(const struct benchCase* bench, size_t n, int runs, int* first);
+static uint64_t nowNs();
+static uint64_t nowCycles();
+
+static const struct benchCase benchCases[] =
+{
+	{ "encode", benchEncode, 0, NULL },
+	{ "decode", benchDecode, 0, NULL },
+	{ "validate", benchValidate, 0, NULL },
+	{ "xor", benchXor, 0, NULL },
+	{ "map_input", benchMapInput, 0, prepareInputFile },
+	{ "legacy_receive", benchLegacyReceive, BENCH_LEGACY_MAX, NULL },
+	{ "stream_receive", benchStreamReceive, 0, NULL }
+};
+
+// message buffers shared by every benchmark, and the input file map_input reads
+static char* benchText;
+static char* benchKey;
+static char* benchOut;
+static char benchFile[] = "/tmp/otp_bench.XXXXXX";
+static int benchFileReady = 0;
+
+// daemon side state for the receive benchmarks
+static const struct otpService benchService = { "otp_bench", 5512, otpEncode, NULL };
+static struct otpServerConfig benchConfig;
+static struct otpConnection benchConn;
+
+// results the compiler must not optimize away
+static volatile size_t benchSink;
+
+int main(int argc, char* argv[])
+{
+	size_t maxSize = (size_t)1 << 30;
+	int runs = 5;
+	const char* only = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "m:r:b:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'm': // largest message size
+				maxSize = strtoull(optarg, NULL, 10);
+				break;
+			case 'r': // timed runs per size
+				runs = atoi(optarg);
+				break;
+			case 'b': // run only this benchmark
+				only = optarg;
+				break;
+			default:
+				fprintf(stderr,"USAGE: %s [-m max-bytes] [-r runs] [-b benchmark]\n", argv[0]);
+				exit(1);
+		}
+	}
+	if(maxSize < BENCH_MIN_SIZE || runs < 1)
+	{
+		fprintf(stderr,"USAGE: %s [-m max-bytes] [-r runs] [-b benchmark]\n", argv[0]);
+		exit(1);
+	}
+
+	otpCodecInit();
+
+	// valid symbols everywhere, so every path does its full work
+	benchText = malloc(maxSize);
+	benchKey = malloc(maxSize);
+	benchOut = malloc(maxSize + 1);
+	if(benchText == NULL || benchKey == NULL || benchOut == NULL)
+	{
+		fprintf(stderr,"Unable to allocate %zu byte buffers.\n", maxSize);
+		exit(1);
+	}
+	size_t i;
+	for(i = 0; i < maxSize; i++)
+	{
+		benchText[i] = otpSymbolChar[(i * 7 + 3) % 27];
+		benchKey[i] = otpSymbolChar[(i * 11 + 5) % 27];
+	}
+
+	benchConfig.port = 0;
+	benchConfig.workers = 0;
+	benchConfig.packageLimit = OTP_BUFFER_UNLIMITED;
+
+	printf("{\n  \"codec\": \"%s\",\n  \"cycles\": \"%s\",\n  \"results\": [", otpCodecName(),
+		nowCycles() != 0 ? "tsc" : "none");
+
+	int first = 1;
+	size_t c;
+	for(c = 0; c < sizeof(benchCases) / sizeof(benchCases[0]); c++)
+	{
+		const struct benchCase* bench = &benchCases[c];
+		if(only != NULL && strcmp(only, bench->name) != 0)
+			continue;
+
+		size_t n;
+		for(n = BENCH_MIN_SIZE; n <= maxSize; n *= BENCH_SIZE_STEP)
+		{
+			if(bench->maxSize != 0 && n > bench->maxSize)
+				break;
+			if(bench->prepare != NULL)
+				bench->prepare(n);
+			runCase(bench, n, runs, &first);
+			if(n > maxSize / BENCH_SIZE_STEP)
+				break;
+		}
+	}
+	printf("\n  ]\n}\n");
+
+	if(benchFileReady)
+		unlink(benchFile);
+	otpConnFree(&benchConn);
+	return 0;
+}
+
+// Times one benchmark at one size and prints its JSON result
+static void runCase(const struct benchCase* bench, size_t n, int runs, int* first)
+{
+	// calibrate: double the iterations until one run is long enough to time
+	uint64_t iterations = 1;
+	while(1)
+	{
+		uint64_t start = nowNs();
+		uint64_t i;
+		for(i = 0; i < iterations; i++)
+			bench->body(n);
+		if(nowNs() - start >= BENCH_MIN_RUN_NS)
+			break;
+		iterations *= 2;
+	}
+
+	// keep the fastest run, the one least disturbed by everything else
+	uint64_t bestNs = UINT64_MAX, bestCycles = 0;
+	int run;
+	for(run = 0; run < runs; run++)
+	{
+		uint64_t startCycles = nowCycles();
+		uint64_t start = nowNs();
+		uint64_t i;
+		for(i = 0; i < iterations; i++)
+			bench->body(n);
+		uint64_t elapsed = nowNs() - start;
+		uint64_t cycles = nowCycles() - startCycles;
+		if(elapsed < bestNs)
+		{
+			bestNs = elapsed;
+			bestCycles = cycles;
+		}
+	}
+
+	double bytes = (double)n * iterations;
+	printf("%s\n    { \"name\": \"%s\", \"bytes\": %zu, \"iterations\": %llu, \"ns_per_byte\": %.4f, \"gb_per_s\": %.3f, \"cycles_per_byte\": ",
+		*first ? "" : ",", bench->name, n, (unsigned long long)iterations, bestNs / bytes, bytes / bestNs);
+	if(bestCycles != 0)
+		printf("%.4f }", bestCycles / bytes);
+	else
+		printf("null }");
+	fflush(stdout);
+	*first = 0;
+}
+
+static void benchEncode(size_t n)
+{
+	otpEncode(benchOut, benchText, benchKey, n);
+}
+
+static void benchDecode(size_t n)
+{
+	otpDecode(benchOut, benchText, benchKey, n);
+}
+
+static void benchValidate(size_t n)
+{
+	benchSink = otpValidate(benchText, n);
+}
+
+static void benchXor(size_t n)
+{
+	otpXor(benchOut, benchText, benchKey, n);
+}
+
+// Writes an n symbol text file (plus newline) for map_input to read
+static void prepareInputFile(size_t n)
+{
+	if(!benchFileReady)
+	{
+		int fd = mkstemp(benchFile);
+		if(fd < 0)
+		{
+			perror("mkstemp");
+			exit(1);
+		}
+		close(fd);
+		benchFileReady = 1;
+	}
+
+	FILE* file = fopen(benchFile, "w");
+	if(file == NULL || fwrite(benchText, 1, n, file) != n || fputc('\n', file) == EOF || fclose(file) != 0)
+	{
+		perror(benchFile);
+		exit(1);
+	}
+}
+
+// what a client does with its input: map, find the newline, validate
+static void benchMapInput(size_t n)
+{
+	struct otpInput input;
+	if(otpMapInput(benchFile, &input) != 0 || (size_t)input.length != n)
+	{
+		fprintf(stderr,"map_input: unexpected result.\n");
+		exit(1);
+	}
+	otpUnmapInput(&input);
+}
+
+// a legacy client's request as the daemon receives it: id, text up to
+// its '?', block padding, key up to its '?'; covers the terminator scan
+static void benchLegacyReceive(size_t n)
+{
+	static const char padding[1024];
+	otpConnReset(&benchConn, &benchService, &benchConfig, NULL, -1);
+
+	feedConnection("5512", 4);
+	feedConnection(benchText, n);
+	feedConnection("?", 1);
+	feedConnection(padding, 1023 - n % 1024);
+	feedConnection(benchKey, n);
+	feedConnection("?", 1);
+}
+
+// a framed client's streamed request as the daemon receives it: chunk
+// pairs through the fixed window, a RESULT_CHUNK for each
+static void benchStreamReceive(size_t n)
+{
+	char wire[OTP_HEADER_SIZE];
+	char id[4];
+	struct otpFrameHeader header = { OTP_FRAME_HELLO, 0, 0, sizeof(id) };
+
+	otpConnReset(&benchConn, &benchService, &benchConfig, NULL, -1);
+	feedConnection(otpPreamble, OTP_PREAMBLE_SIZE);
+	otpPack32(id, 5512);
+	otpPackHeader(wire, &header);
+	feedConnection(wire, sizeof(wire));
+	feedConnection(id, sizeof(id));
+
+	size_t sent;
+	for(sent = 0; sent < n; sent += OTP_CHUNK_SIZE)
+	{
+		size_t chunk = (n - sent < OTP_CHUNK_SIZE) ? n - sent : OTP_CHUNK_SIZE;
+		struct otpFrameHeader textHeader = { OTP_FRAME_TEXT_CHUNK, 0, 1, chunk };
+		struct otpFrameHeader keyHeader = { OTP_FRAME_KEY_CHUNK, 0, 1, chunk };
+
+		otpPackHeader(wire, &textHeader);
+		feedConnection(wire, sizeof(wire));
+		feedConnection(benchText + sent, chunk);
+		otpPackHeader(wire, &keyHeader);
+		feedConnection(wire, sizeof(wire));
+		feedConnection(benchKey + sent, chunk);
+	}
+
+	struct otpFrameHeader endHeader = { OTP_FRAME_END, 0, 1, 0 };
+	otpPackHeader(wire, &endHeader);
+	feedConnection(wire, sizeof(wire));
+}
+
+// Hands data to the connection the way a backend does, copying it into
+// each window as recv() would and discarding the output as if sent
+static void feedConnection(const char* data, size_t length)
+{
+	while(length > 0)
+	{
+		char* window;
+		size_t room = otpConnWindow(&benchConn, &window);
+		if(room == 0)
+		{
+			fprintf(stderr,"Connection refused input.\n");
+			exit(1);
+		}
+		if(room > length)
+			room = length;
+
+		memcpy(window, data, room);
+		if(!otpConnFeed(&benchConn, window, room))
+		{
+			fprintf(stderr,"Connection rejected the request.\n");
+			exit(1);
+		}
+
+		const char* pending;
+		size_t waiting;
+		while((waiting = otpConnPending(&benchConn, &pending)) > 0)
+			otpConnSent(&benchConn, waiting);
+
+		data += room;
+		length -= room;
+	}
+}
+
+// monotonic wall clock in nanoseconds
+static uint64_t nowNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// time stamp counter (reference cycles), 0 where there is none
+static uint64_t nowCycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
@@ -0,0 +1,54 @@
+#include <stdlib.h>
+#include <string.h>
+#include "otp_buffer.h"
+
+// buffers start this big and double from there
+#define OTP_INITIAL_CAPACITY 4096
+
+int otpBufferReserve(struct otpBuffer* buffer, size_t needed, size_t limit)
+{
+	if(needed <= buffer->capacity)
+		return 1;
+	if(needed > limit)
+		return 0;
+
+	// double until it fits, stopping at the limit rather than overflowing
+	size_t newCapacity = (buffer->capacity > 0) ? buffer->capacity : OTP_INITIAL_CAPACITY;
+	while(newCapacity < needed && newCapacity <= limit / 2)
+		newCapacity *= 2;
+	if(newCapacity < needed)
+		newCapacity = limit;
+
+	char* grown = realloc(buffer->data, newCapacity);
+	if(grown == NULL)
+	{
+		// doubling may ask for far more than needed, try the exact size
+		newCapacity = needed;
+		grown = realloc(buffer->data, newCapacity);
+		if(grown == NULL)
+			return 0;
+	}
+	buffer->data = grown;
+	buffer->capacity = newCapacity;
+	return 1;
+}
+
+int otpBufferAppend(struct otpBuffer* buffer, const char* data, size_t n, size_t limit)
+{
+	if(n > limit || buffer->length > limit - n)
+		return 0;
+	if(!otpBufferReserve(buffer, buffer->length + n, limit))
+		return 0;
+	if(data != buffer->data + buffer->length)
+		memmove(buffer->data + buffer->length, data, n);
+	buffer->length += n;
+	return 1;
+}
+
+void otpBufferFree(struct otpBuffer* buffer)
+{
+	free(buffer->data);
+	buffer->data = NULL;
+	buffer->length = 0;
+	buffer->capacity = 0;
+}
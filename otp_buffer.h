@@ -0,0 +1,30 @@
+#ifndef OTP_BUFFER_H
+#define OTP_BUFFER_H
+
+#include <stddef.h>
+
+// Growable byte buffer (libotp). Capacity doubles as it fills so appending
+// n bytes in any number of pieces costs O(n) copies overall.
+
+struct otpBuffer
+{
+	char* data;
+	size_t length;			// bytes in use
+	size_t capacity;		// bytes allocated
+};
+
+// no limit on how far a buffer may grow
+#define OTP_BUFFER_UNLIMITED ((size_t)-1)
+
+// makes sure the buffer can hold at least needed bytes without going past limit
+// returns 0 if needed is over the limit or memory runs out
+int otpBufferReserve(struct otpBuffer* buffer, size_t needed, size_t limit);
+
+// appends n bytes, copying only if they were not received in place
+// returns 0 if the buffer cannot grow that far
+int otpBufferAppend(struct otpBuffer* buffer, const char* data, size_t n, size_t limit);
+
+// releases the memory, leaving an empty buffer
+void otpBufferFree(struct otpBuffer* buffer);
+
+#endif
@@ -0,0 +1,729 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <time.h>
+#include "otp_codec.h"
+#include "otp_buffer.h"
+#include "otp_pad.h"
+#include "otp_client.h"
+
+// error handler
+// takes msg to print and boolean for whether to use perror
+// or normal error output. (perror used when errno is set)
+static void error(const char *msg, int perrorOutput)
+{
+	if(perrorOutput)
+	{
+		perror(msg);
+		exit(1);
+	}
+	else
+	{
+		fprintf(stderr,"%s\n",msg);
+		exit(1);
+	}
+}
+
+// one side of otpMapInputs, validated on its own thread
+struct scanJob
+{
+	struct otpInput* input;
+	int status;
+};
+
+// receive side of a pipeline: the answer being read and its frame
+struct answerState
+{
+	char wire[OTP_HEADER_SIZE];
+	size_t wireGot;			// header bytes so far
+	size_t index;			// request being answered
+	uint64_t received;		// bytes of its result so far
+	uint64_t payloadLeft;	// of the current RESULT_CHUNK
+	int inPayload;
+};
+
+// forward declarations
+static void sendAll(int socketFD, const char* data, size_t length);
+static void receiveAll(int socketFD, char* data, size_t length);
+static void receiveHeader(int socketFD, struct otpFrameHeader* header);
+static void receiveServerError(int socketFD, const char* got, size_t gotLength, uint64_t length, char* message, size_t size);
+static size_t advanceVector(struct iovec* vector, size_t count, size_t sent);
+static int takeAnswers(int socketFD, struct otpRequest* requests, size_t count, struct answerState* answers, const char* data, size_t length,
+	char* message, size_t messageSize);
+static void writeOut(int fd, struct iovec* vector, size_t count);
+static int connectUnix(const char* path);
+static int loadInput(int fd, struct otpInput* input);
+static int scanInput(struct otpInput* input);
+static void* scanThread(void* argument);
+
+int otpMapInput(const char* path, struct otpInput* input)
+{
+	int fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	int status = otpMapInputFD(fd, input);
+	close(fd);
+	return status;
+}
+
+int otpMapInputFD(int fd, struct otpInput* input)
+{
+	if(loadInput(fd, input) < 0)
+		return -1;
+	return scanInput(input);
+}
+
+int otpMapInputs(const char* textPath, struct otpInput* text, const char* keyPath, struct otpInput* key, int* keyStatus, int binary)
+{
+	memset(key, 0, sizeof(*key));
+	*keyStatus = 0;
+
+	int textFD = open(textPath, O_RDONLY);
+	if(textFD < 0)
+		return -1;
+	int keyFD = -1;
+	if(keyPath != NULL && (keyFD = open(keyPath, O_RDONLY)) < 0)
+	{
+		// the text still gets its own status, errno stays the key's
+		int saved = errno;
+		int textStatus = otpMapInputsFD(textFD, text, -1, key, keyStatus, binary);
+		close(textFD);
+		*keyStatus = -1;
+		errno = saved;
+		return textStatus;
+	}
+
+	int textStatus = otpMapInputsFD(textFD, text, keyFD, key, keyStatus, binary);
+	close(textFD);
+	if(keyFD >= 0)
+		close(keyFD);
+	return textStatus;
+}
+
+int otpMapInputsFD(int textFD, struct otpInput* text, int keyFD, struct otpInput* key, int* keyStatus, int binary)
+{
+	memset(key, 0, sizeof(*key));
+	*keyStatus = 0;
+
+	// both are loaded before either is looked at
+	if(loadInput(textFD, text) < 0)
+		return -1;
+	if(keyFD >= 0)
+		*keyStatus = loadInput(keyFD, key);
+
+	// raw bytes have no end of line and nothing invalid to look for
+	if(binary)
+	{
+		text->length = text->size;
+		key->length = key->size;
+		return 0;
+	}
+
+	// large enough to be worth a thread: the key is validated beside the text
+	struct scanJob keyJob = { key, 0 };
+	pthread_t keyThread;
+	int threaded = keyFD >= 0 && *keyStatus == 0
+		&& text->size >= OTP_PARALLEL_SCAN_MIN && key->size >= OTP_PARALLEL_SCAN_MIN
+		&& pthread_create(&keyThread, NULL, scanThread, &keyJob) == 0;
+
+	int textStatus = scanInput(text);
+
+	if(threaded)
+	{
+		pthread_join(keyThread, NULL);
+		*keyStatus = keyJob.status;
+	}
+	else if(keyFD >= 0 && *keyStatus == 0)
+		*keyStatus = scanInput(key);
+	return textStatus;
+}
+
+void otpUnmapInput(struct otpInput* input)
+{
+	if(input->mapped)
+		munmap((void*)input->data, input->size);
+	else
+		free((void*)input->data);
+	input->data = NULL;
+	input->size = 0;
+}
+
+int otpConnect(const char* address)
+{
+	// a daemon on this host, without the TCP/IP stack in between
+	if(strncmp(address, "unix:", 5) == 0)
+		return connectUnix(address + 5);
+
+	// host:port names the machine; a bare port means the class server
+	char host[256] = "eos-class.engr.oregonstate.edu";
+	const char* port = strrchr(address, ':');
+	if(port != NULL)
+	{
+		size_t hostLength = port - address;
+		if(hostLength == 0 || hostLength >= sizeof(host))
+			error("CLIENT: ERROR, bad host",0);
+		memcpy(host, address, hostLength);
+		host[hostLength] = '\0';
+		port++;
+	}
+	else
+		port = address;
+	int portNumber = atoi(port);
+
+	// below structs used to build and connect to server
+	struct sockaddr_in serverAddress;
+	struct hostent* serverHostInfo;
+
+	// Set up the server address struct
+	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+	serverAddress.sin_family = AF_INET; // Create a network-capable socket
+	serverAddress.sin_port = htons(portNumber); // Store the port number
+	serverHostInfo = gethostbyname(host); // Convert the machine name into a special form of address
+	if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR, no such host\n"); exit(0); }
+	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
+
+	// Set up the socket
+	int socketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
+	if (socketFD < 0) error("CLIENT: ERROR opening socket", 1);
+
+	// Connect to server
+	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
+		error("CLIENT: ERROR connecting",1);
+
+	// requests end in a small END frame; send it without waiting for an ACK
+	int noDelay = 1;
+	setsockopt(socketFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	return socketFD;
+}
+
+int otpHandshake(int socketFD, int handshakeId, int flags)
+{
+	// preamble marks this as a framed client, HELLO carries the id and the modes asked for
+	char hello[OTP_PREAMBLE_SIZE + OTP_HEADER_SIZE + 4];
+	struct otpFrameHeader header = { OTP_FRAME_HELLO, flags, 0, 4 };
+	memcpy(hello, otpPreamble, OTP_PREAMBLE_SIZE);
+	otpPackHeader(hello + OTP_PREAMBLE_SIZE, &header);
+	otpPack32(hello + OTP_PREAMBLE_SIZE + OTP_HEADER_SIZE, (uint32_t)handshakeId);
+	sendAll(socketFD, hello, sizeof(hello));
+
+	// ACCEPT, DENY or BUSY, none carries a payload; ACCEPT echoes the modes granted,
+	// and a daemon from before binary mode grants none
+	struct otpFrameHeader response;
+	receiveHeader(socketFD, &response);
+	if(response.type == OTP_FRAME_ACCEPT)
+	{
+		if((response.flags & flags) != flags)
+			error("Daemon does not support binary mode.",0);
+		return 1;
+	}
+	if(response.type == OTP_FRAME_BUSY)
+		return OTP_BUSY;
+	if(response.type != OTP_FRAME_DENY)
+		error("Unexpected handshake response from server.",0);
+	return 0;
+}
+
+int otpOpen(const char* address, int handshakeId, int flags)
+{
+	// spreads out the retries of clients that were turned away together
+	static unsigned int seed = 0;
+	if(seed == 0)
+		seed = (unsigned int)getpid() ^ (unsigned int)time(NULL);
+
+	int pause = OTP_BUSY_PAUSE_MS;
+	int attempt;
+	for(attempt = 1; ; attempt++)
+	{
+		int socketFD = otpConnect(address);
+		int answer = otpHandshake(socketFD, handshakeId, flags);
+		if(answer == 1)
+			return socketFD;
+		close(socketFD);
+		if(answer == 0)
+			return -1;
+		if(attempt == OTP_BUSY_ATTEMPTS)
+			error("Server is busy, try again later.",0);
+
+		// somewhere between half the pause and all of it, then twice as long
+		int wait = pause / 2 + rand_r(&seed) % (pause / 2 + 1);
+		usleep((useconds_t)wait * 1000);
+		if(pause < OTP_BUSY_PAUSE_MAX_MS)
+			pause *= 2;
+	}
+}
+
+int otpParsePadReference(char* argument, struct otpRequest* request)
+{
+	if(strncmp(argument, "pad:", 4) != 0)
+		return 0;
+
+	request->pad = argument + 4;
+	request->padOffset = 0;
+
+	// an optional :offset after the name
+	char* offset = strchr(request->pad, ':');
+	if(offset != NULL)
+	{
+		char* end;
+		*offset = '\0';
+		request->padOffset = strtoull(offset + 1, &end, 10);
+		if(*end != '\0' || end == offset + 1)
+			error("Invalid pad offset.",0);
+	}
+	if(*request->pad == '\0' || strlen(request->pad) > OTP_PAD_NAME_MAX)
+		error("Invalid pad name.",0);
+	return 1;
+}
+
+size_t otpPipeline(int socketFD, struct otpRequest* requests, size_t count, char* message, size_t messageSize)
+{
+	// send side: the frames being written, payloads straight from text and key
+	char headers[2][OTP_HEADER_SIZE];
+	struct iovec vector[4];
+	size_t vectorFirst = 0, vectorCount = 0;
+	size_t sendIndex = 0;
+	uint64_t queued = 0;
+	int started = 0, referenced = 0;
+
+	// receive side: the frame being read, and a buffer for large reads
+	struct answerState answers;
+	memset(&answers, 0, sizeof(answers));
+	char* incoming = malloc(OTP_RECEIVE_SIZE);
+	if(incoming == NULL)
+		error("Unable to allocate receive buffer.",0);
+
+	while(answers.index < count)
+	{
+		// once the last frames are out, queue the pad reference, the next
+		// chunk pair, or the END of this request; the next request follows
+		// without waiting
+		if(vectorFirst == vectorCount && sendIndex < count)
+		{
+			struct otpRequest* request = &requests[sendIndex];
+			uint32_t id = (uint32_t)(sendIndex + 1);
+			uint64_t chunk = request->length - queued;
+			if(chunk > OTP_CHUNK_SIZE)
+				chunk = OTP_CHUNK_SIZE;
+			vectorFirst = 0;
+
+			// a pad held by the daemon opens the request instead of key chunks
+			if(request->pad != NULL && !referenced)
+			{
+				size_t nameLength = strlen(request->pad);
+				struct otpFrameHeader refHeader = { OTP_FRAME_KEY_REF, 0, id, OTP_KEY_REF_OFFSET_SIZE + nameLength };
+				otpPackHeader(headers[0], &refHeader);
+				otpPack64(headers[1], request->padOffset);
+				vector[0].iov_base = headers[0];
+				vector[0].iov_len = OTP_HEADER_SIZE;
+				vector[1].iov_base = headers[1];
+				vector[1].iov_len = OTP_KEY_REF_OFFSET_SIZE;
+				vector[2].iov_base = (char*)request->pad;
+				vector[2].iov_len = nameLength;
+				vectorCount = 3;
+				referenced = 1;
+			}
+			// an empty text still sends one (empty) pair to open the stream
+			else if(chunk > 0 || !started)
+			{
+				struct otpFrameHeader textHeader = { OTP_FRAME_TEXT_CHUNK, 0, id, chunk };
+				struct otpFrameHeader keyHeader = { OTP_FRAME_KEY_CHUNK, 0, id, chunk };
+				otpPackHeader(headers[0], &textHeader);
+				otpPackHeader(headers[1], &keyHeader);
+				vector[0].iov_base = headers[0];
+				vector[0].iov_len = OTP_HEADER_SIZE;
+				vector[1].iov_base = (char*)request->text + queued;
+				vector[1].iov_len = chunk;
+				vector[2].iov_base = headers[1];
+				vector[2].iov_len = OTP_HEADER_SIZE;
+				vector[3].iov_base = (char*)request->key + queued;
+				vector[3].iov_len = chunk;
+				vectorCount = (request->pad != NULL) ? 2 : 4;
+				queued += chunk;
+				started = 1;
+			}
+			else
+			{
+				struct otpFrameHeader endHeader = { OTP_FRAME_END, 0, id, 0 };
+				otpPackHeader(headers[0], &endHeader);
+				vector[0].iov_base = headers[0];
+				vector[0].iov_len = OTP_HEADER_SIZE;
+				vectorCount = 1;
+				sendIndex++;
+				queued = 0;
+				started = 0;
+				referenced = 0;
+			}
+		}
+
+		// always read, write while there is something queued, so the
+		// daemon never stalls waiting for us to take its results
+		struct pollfd ready = { socketFD, POLLIN, 0 };
+		if(vectorFirst < vectorCount)
+			ready.events |= POLLOUT;
+		if(poll(&ready, 1, -1) < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			error("CLIENT: ERROR polling socket",1);
+		}
+
+		if(ready.revents & POLLOUT)
+		{
+			struct msghdr message;
+			memset(&message, 0, sizeof(message));
+			message.msg_iov = vector + vectorFirst;
+			message.msg_iovlen = vectorCount - vectorFirst;
+
+			ssize_t sent = sendmsg(socketFD, &message, MSG_DONTWAIT | MSG_NOSIGNAL);
+			if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				error("CLIENT: ERROR writing to socket",1);
+			if(sent > 0)
+				vectorFirst += advanceVector(vector + vectorFirst, vectorCount - vectorFirst, sent);
+		}
+
+		if(!(ready.revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		// answers come back in request order; a result that is kept is
+		// allocated as it starts, and the rest of its payload read into it
+		struct otpRequest* answer = &requests[answers.index];
+		ssize_t charsRead;
+		if(answer->outFD < 0 && answer->result == NULL)
+		{
+			answer->result = malloc(answer->length + 1);
+			if(answer->result == NULL)
+				error("Unable to allocate result.",0);
+		}
+		if(answers.inPayload && answer->outFD < 0)
+			charsRead = recv(socketFD, answer->result + answers.received, answers.payloadLeft, MSG_DONTWAIT);
+		else
+			charsRead = recv(socketFD, incoming, OTP_RECEIVE_SIZE, MSG_DONTWAIT);
+
+		if(charsRead == 0)
+			error("CLIENT: server closed the connection early",0);
+		if(charsRead < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				continue;
+			error("CLIENT: ERROR reading from socket",1);
+		}
+
+		if(answers.inPayload && answer->outFD < 0)
+		{
+			answers.received += charsRead;
+			answers.payloadLeft -= charsRead;
+			answers.inPayload = (answers.payloadLeft > 0);
+		}
+		else if(!takeAnswers(socketFD, requests, count, &answers, incoming, charsRead, message, messageSize))
+			break;
+	}
+	free(incoming);
+	return answers.index;
+}
+
+void otpReserveOutput(int fd, uint64_t length)
+{
+	struct stat info;
+	if(length == 0 || fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+		return;
+
+	// the size still grows only as the result is written, so a transfer
+	// cut short leaves no stretch of zeros behind
+	fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, length);
+}
+
+// Connects to the daemon listening on the UNIX socket at path
+static int connectUnix(const char* path)
+{
+	struct sockaddr_un serverAddress;
+	memset(&serverAddress, 0, sizeof(serverAddress));
+	serverAddress.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(serverAddress.sun_path))
+		error("CLIENT: ERROR, socket path is too long",0);
+	strcpy(serverAddress.sun_path, path);
+
+	int socketFD = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (socketFD < 0) error("CLIENT: ERROR opening socket", 1);
+	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
+		error("CLIENT: ERROR connecting",1);
+	return socketFD;
+}
+
+// Maps fd, or reads it whole if it cannot be mapped, without looking at
+// the contents. Returns 0, or -1 if it cannot be read (errno is set)
+static int loadInput(int fd, struct otpInput* input)
+{
+	struct stat info;
+	if(fstat(fd, &info) < 0)
+		return -1;
+
+	input->data = NULL;
+	input->size = 0;
+	input->mapped = 0;
+	input->length = 0;
+	input->invalid = -1;
+
+	// regular files are mapped and used in place, nothing is copied
+	if(S_ISREG(info.st_mode) && info.st_size > 0)
+	{
+		if((uint64_t)info.st_size > SIZE_MAX)
+			error("File is too large to load.",0);
+		void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if(mapping != MAP_FAILED)
+		{
+			madvise(mapping, info.st_size, MADV_SEQUENTIAL);
+			input->data = mapping;
+			input->size = info.st_size;
+			input->mapped = 1;
+		}
+	}
+
+	// pipes and the like can only be read, so read them into memory once
+	if(!input->mapped)
+	{
+		struct otpBuffer buffer = { NULL, 0, 0 };
+		while(1)
+		{
+			if(!otpBufferReserve(&buffer, buffer.length + 65536, OTP_BUFFER_UNLIMITED))
+				error("Unable to allocate input.",0);
+			ssize_t got = read(fd, buffer.data + buffer.length, buffer.capacity - buffer.length);
+			if(got < 0 && errno == EINTR)
+				continue;
+			if(got < 0)
+			{
+				otpBufferFree(&buffer);
+				return -1;
+			}
+			if(got == 0)
+				break;
+			buffer.length += got;
+		}
+		input->data = buffer.data;
+		input->size = buffer.length;
+	}
+	return 0;
+}
+
+// Finds the end of the text (its first newline) and checks every symbol
+// before it in the same pass: a newline is the first byte otpValidate
+// stops at on a valid line. Returns 0, or -3 if an invalid character was found
+static int scanInput(struct otpInput* input)
+{
+	size_t stop = otpValidate(input->data, input->size);
+	if(stop < input->size && input->data[stop] != '\n')
+	{
+		input->invalid = stop;
+		input->length = stop;
+		return -3;
+	}
+	input->length = stop;
+	return 0;
+}
+
+static void* scanThread(void* argument)
+{
+	struct scanJob* job = argument;
+	job->status = scanInput(job->input);
+	return NULL;
+}
+
+// Takes apart length received bytes: frame headers, and payloads that are
+// copied into kept results or written out, several frames per writev.
+// Returns 1, or 0 once the daemon refused the request being answered,
+// with its message in message and every earlier answer written out
+static int takeAnswers(int socketFD, struct otpRequest* requests, size_t count, struct answerState* answers, const char* data, size_t length,
+	char* message, size_t messageSize)
+{
+	struct iovec pending[OTP_RECEIVE_VECTOR];
+	size_t pendingCount = 0;
+	int pendingFD = -1;
+	size_t at = 0;
+
+	while(at < length)
+	{
+		if(answers->index >= count)
+			error("Unexpected response from server.",0);
+		struct otpRequest* answer = &requests[answers->index];
+
+		if(answers->inPayload)
+		{
+			size_t take = (answers->payloadLeft < length - at) ? answers->payloadLeft : length - at;
+			if(answer->outFD < 0)
+				memcpy(answer->result + answers->received, data + at, take);
+			else
+			{
+				// one writev per output, in order
+				if(pendingCount == OTP_RECEIVE_VECTOR || (pendingCount > 0 && pendingFD != answer->outFD))
+				{
+					writeOut(pendingFD, pending, pendingCount);
+					pendingCount = 0;
+				}
+				pending[pendingCount].iov_base = (char*)data + at;
+				pending[pendingCount].iov_len = take;
+				pendingCount++;
+				pendingFD = answer->outFD;
+			}
+			at += take;
+			answers->received += take;
+			answers->payloadLeft -= take;
+			answers->inPayload = (answers->payloadLeft > 0);
+			continue;
+		}
+
+		size_t take = OTP_HEADER_SIZE - answers->wireGot;
+		if(take > length - at)
+			take = length - at;
+		memcpy(answers->wire + answers->wireGot, data + at, take);
+		answers->wireGot += take;
+		at += take;
+		if(answers->wireGot < OTP_HEADER_SIZE)
+			break;
+		answers->wireGot = 0;
+
+		struct otpFrameHeader frame;
+		otpUnpackHeader(answers->wire, &frame);
+		if(frame.type == OTP_FRAME_ERROR)
+		{
+			// the daemon reads nothing more on this connection after an ERROR
+			if(pendingCount > 0)
+				writeOut(pendingFD, pending, pendingCount);
+			receiveServerError(socketFD, data + at, length - at, frame.length, message, messageSize);
+			return 0;
+		}
+		if(frame.request != (uint32_t)(answers->index + 1))
+			error("Unexpected response from server.",0);
+
+		if(frame.type == OTP_FRAME_END)
+		{
+			if(answers->received != answer->length)
+				error("CLIENT: server sent a short result",0);
+			if(answer->outFD < 0)
+				answer->result[answers->received] = '\0';
+			answers->index++;
+			answers->received = 0;
+
+			// the next answer may be kept rather than written
+			if(answers->index < count && requests[answers->index].outFD < 0 && requests[answers->index].result == NULL)
+			{
+				requests[answers->index].result = malloc(requests[answers->index].length + 1);
+				if(requests[answers->index].result == NULL)
+					error("Unable to allocate result.",0);
+			}
+		}
+		else if(frame.type != OTP_FRAME_RESULT_CHUNK || frame.length > answer->length - answers->received)
+			error("Unexpected response from server.",0);
+		else
+		{
+			answers->payloadLeft = frame.length;
+			answers->inPayload = (answers->payloadLeft > 0);
+		}
+	}
+
+	if(pendingCount > 0)
+		writeOut(pendingFD, pending, pendingCount);
+	return 1;
+}
+
+// Writes every byte of an I/O vector to fd
+static void writeOut(int fd, struct iovec* vector, size_t count)
+{
+	size_t first = 0;
+	while(first < count)
+	{
+		ssize_t written = writev(fd, vector + first, count - first);
+		if(written < 0 && errno == EINTR)
+			continue;
+		if(written < 0)
+			error("CLIENT: ERROR writing result",1);
+		first += advanceVector(vector + first, count - first, written);
+	}
+}
+
+// Drops sent bytes from the front of an I/O vector
+// returns how many entries were fully sent
+static size_t advanceVector(struct iovec* vector, size_t count, size_t sent)
+{
+	size_t done = 0;
+	while(done < count && sent >= vector[done].iov_len)
+	{
+		sent -= vector[done].iov_len;
+		done++;
+	}
+	if(done < count)
+	{
+		vector[done].iov_base = (char*)vector[done].iov_base + sent;
+		vector[done].iov_len -= sent;
+	}
+	return done;
+}
+
+// Sends every byte, retrying partial sends
+static void sendAll(int socketFD, const char* data, size_t length)
+{
+	size_t totalSent = 0;
+	while(totalSent < length)
+	{
+		ssize_t sent = send(socketFD, data + totalSent, length - totalSent, MSG_NOSIGNAL);
+		if(sent < 0 && errno == EINTR)
+			continue;
+		if(sent < 0)
+			error("CLIENT: ERROR writing to socket",1);
+		totalSent += sent;
+	}
+}
+
+// Receives exactly length bytes into data
+static void receiveAll(int socketFD, char* data, size_t length)
+{
+	size_t totalRead = 0;
+	while(totalRead < length)
+	{
+		ssize_t charsRead = recv(socketFD, data + totalRead, length - totalRead, 0);
+		if(charsRead < 0 && errno == EINTR)
+			continue;
+		if(charsRead < 0)
+			error("CLIENT: ERROR reading from socket",1);
+		if(charsRead == 0)
+			error("CLIENT: server closed the connection early",0);
+		totalRead += charsRead;
+	}
+}
+
+// Receives and decodes one frame header
+static void receiveHeader(int socketFD, struct otpFrameHeader* header)
+{
+	char wire[OTP_HEADER_SIZE];
+	receiveAll(socketFD, wire, sizeof(wire));
+	otpUnpackHeader(wire, header);
+}
+
+// Reads the message carried by an ERROR frame into message (size bytes,
+// terminated, longer ones cut short); the first gotLength bytes of it
+// may already have been received into got
+static void receiveServerError(int socketFD, const char* got, size_t gotLength, uint64_t length, char* message, size_t size)
+{
+	if(length >= size)
+		length = size - 1;
+	if(gotLength > length)
+		gotLength = length;
+	if(gotLength > 0)
+		memcpy(message, got, gotLength);
+	receiveAll(socketFD, message + gotLength, length - gotLength);
+	message[length] = '\0';
+}
@@ -0,0 +1,111 @@
+#ifndef OTP_CLIENT_H
+#define OTP_CLIENT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include "otp_proto.h"
+
+// Client side of the framed protocol (libotp), shared by otp_enc and otp_dec.
+// Like the rest of the clients, these print a message and exit on failure.
+
+// a text or key file, mapped (or read, if it cannot be mapped) in full
+struct otpInput
+{
+	const char* data;
+	off_t length;			// symbols before the first newline (or the invalid byte), every byte when binary
+	off_t invalid;			// offset of the first invalid byte, -1 if there is none
+	size_t size;			// bytes of data
+	int mapped;
+};
+
+// Maps the file at path and validates the text up to its first newline
+// in place, one pass finding both. Returns 0, -1 if the file cannot be
+// opened or read (errno is set), or -3 if an invalid character was found
+int otpMapInput(const char* path, struct otpInput* input);
+
+// The same for a file already open as fd, which stays open
+int otpMapInputFD(int fd, struct otpInput* input);
+
+// inputs at least this large are validated on two threads by otpMapInputs
+#define OTP_PARALLEL_SCAN_MIN (1024 * 1024)
+
+// Maps a text and its key (none if keyPath is NULL) as otpMapInput would,
+// then validates both at once when they are large. Returns the text's
+// status and stores the key's; the key is left alone if the text fails
+// to load. With binary set both are raw bytes, used whole and unchecked
+int otpMapInputs(const char* textPath, struct otpInput* text, const char* keyPath, struct otpInput* key, int* keyStatus, int binary);
+
+// The same for files already open (keyFD -1 for none), which stay open
+int otpMapInputsFD(int textFD, struct otpInput* text, int keyFD, struct otpInput* key, int* keyStatus, int binary);
+
+// Releases what otpMapInput set up
+void otpUnmapInput(struct otpInput* input);
+
+// Connects to the daemon at address: <host>:<port>, a bare port on the
+// class server, or unix:<path> for one listening on a UNIX socket;
+// returns the socket
+int otpConnect(const char* address);
+
+// Performs the framed handshake asking for the OTP_HELLO_ modes in flags,
+// returns 1 if the daemon accepted handshakeId, 0 if it denied it, or
+// OTP_BUSY if it is at an admission limit and closing the connection.
+// A daemon that accepts without granting every mode asked for is an error
+int otpHandshake(int socketFD, int handshakeId, int flags);
+
+#define OTP_BUSY -1
+
+// how often otpOpen tries a busy daemon, and how long it waits after the
+// first attempt; each wait after that is twice as long, up to the longest
+#define OTP_BUSY_ATTEMPTS 10
+#define OTP_BUSY_PAUSE_MS 10
+#define OTP_BUSY_PAUSE_MAX_MS 1000
+
+// Connects to address and performs the handshake, reconnecting after a
+// randomized, growing pause while the daemon answers BUSY. Returns the
+// socket, or -1 if the daemon denied handshakeId
+int otpOpen(const char* address, int handshakeId, int flags);
+
+// bytes a pipeline reads from the socket at once, and the most payload
+// pieces it hands to one writev
+#define OTP_RECEIVE_SIZE (256 * 1024)
+#define OTP_RECEIVE_VECTOR 16
+
+// one request of a pipeline; its answer is written to outFD as it
+// arrives, or, with outFD -1, result is allocated and filled in (and
+// terminated) once the whole answer is in
+struct otpRequest
+{
+	const char* text;
+	const char* key;		// ignored when pad is set
+	uint64_t length;		// symbols of text, and of key used
+	const char* pad;		// name of a pad the daemon holds, or NULL to send key
+	uint64_t padOffset;		// first pad symbol to use
+	int outFD;
+	char* result;
+};
+
+// Recognizes a key argument of the form pad:<name>[:<offset>], naming a
+// pad the daemon holds. Returns 1 and points request->pad into argument
+// (which is modified), 0 if argument is an ordinary key file
+int otpParsePadReference(char* argument, struct otpRequest* request);
+
+// room for the message of an ERROR frame, with its terminator
+#define OTP_ERROR_MAX 256
+
+// Sends every request over the one connection, streaming each as
+// alternating text and key chunks without waiting for earlier answers,
+// and takes the answers, which arrive in order, in large reads. Returns
+// count, or the index of the first request the daemon refused, with its
+// message stored in message (messageSize bytes, e.g. OTP_ERROR_MAX).
+// Every request before it has been answered in full; the rest were not
+// answered, and the connection is of no further use: the daemon reads
+// nothing more on it
+size_t otpPipeline(int socketFD, struct otpRequest* requests, size_t count, char* message, size_t messageSize);
+
+// Reserves length bytes for a result about to be written to the regular
+// file fd from its start, so the writes find the blocks allocated; does
+// nothing where the file system cannot
+void otpReserveOutput(int fd, uint64_t length);
+
+
+#endif
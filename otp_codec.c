@@ -0,0 +1,508 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "otp_codec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define OTP_X86 1
+#endif
+
+/*
+ * Every kernel uses the same branch free arithmetic so that the scalar
+ * fallback produces byte-for-byte the same output as the vector ones:
+ *
+ *   symbol  = min((unsigned char)(c - 'A'), 26)   'A'-'Z' -> 0-25, rest -> 26
+ *   encode  = s - 27 if s >= 27, where s = p + k   (min(s, s - 27) unsigned)
+ *   decode  = d - 27 if d >= 27, where d = p - k + 27
+ *   char    = symbol + 'A', minus ('[' - ' ') when symbol is 26
+ *
+ * The scalar path reads the same mapping out of the tables below, which
+ * the preprocessor expands at compile time.
+ */
+
+// distance from '[' (26 + 'A') down to ' ', used to turn symbol 26 into a space
+#define OTP_SPACE_GAP ('[' - ' ')
+
+// per-entry formulas the tables are built from
+#define SYMBOL_OF(c) (((c) >= 'A' && (c) <= 'Z') ? (c) - 'A' : 26)
+#define INVALID(c) (((c) >= 'A' && (c) <= 'Z') || (c) == ' ' ? 0 : 1)
+#define CHAR_OF(s) ((s) == 26 ? ' ' : 'A' + (s))
+#define ADD_CELL(a, b) CHAR_OF(((a) + (b)) % 27)
+#define SUB_CELL(a, b) CHAR_OF(((a) - (b) + 27) % 27)
+
+// repeat f over a run of byte values
+#define REP4(f, n) f(n), f(n + 1), f(n + 2), f(n + 3)
+#define REP16(f, n) REP4(f, n), REP4(f, n + 4), REP4(f, n + 8), REP4(f, n + 12)
+#define REP64(f, n) REP16(f, n), REP16(f, n + 16), REP16(f, n + 32), REP16(f, n + 48)
+#define REP256(f) REP64(f, 0), REP64(f, 64), REP64(f, 128), REP64(f, 192)
+
+// one row of a 27x27 table: f(a, 0) .. f(a, 26)
+#define ROW27(f, a) { f(a, 0), f(a, 1), f(a, 2), f(a, 3), f(a, 4), f(a, 5), f(a, 6), \
+	f(a, 7), f(a, 8), f(a, 9), f(a, 10), f(a, 11), f(a, 12), f(a, 13), f(a, 14), \
+	f(a, 15), f(a, 16), f(a, 17), f(a, 18), f(a, 19), f(a, 20), f(a, 21), f(a, 22), \
+	f(a, 23), f(a, 24), f(a, 25), f(a, 26) }
+#define TABLE27(f) { ROW27(f, 0), ROW27(f, 1), ROW27(f, 2), ROW27(f, 3), ROW27(f, 4), \
+	ROW27(f, 5), ROW27(f, 6), ROW27(f, 7), ROW27(f, 8), ROW27(f, 9), ROW27(f, 10), \
+	ROW27(f, 11), ROW27(f, 12), ROW27(f, 13), ROW27(f, 14), ROW27(f, 15), ROW27(f, 16), \
+	ROW27(f, 17), ROW27(f, 18), ROW27(f, 19), ROW27(f, 20), ROW27(f, 21), ROW27(f, 22), \
+	ROW27(f, 23), ROW27(f, 24), ROW27(f, 25), ROW27(f, 26) }
+
+const uint8_t otpSymbolMap[256] = { REP256(SYMBOL_OF) };
+const uint8_t otpInvalidMap[256] = { REP256(INVALID) };
+const char otpSymbolChar[27] = { REP16(CHAR_OF, 0), REP4(CHAR_OF, 16), REP4(CHAR_OF, 20), CHAR_OF(24), CHAR_OF(25), CHAR_OF(26) };
+
+// the result character for each (text, key) symbol pair
+static const char encodeTable[27][27] = TABLE27(ADD_CELL);
+static const char decodeTable[27][27] = TABLE27(SUB_CELL);
+
+static void encodeScalar(char* cipher, const char* plain, const char* key, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i++)
+		cipher[i] = encodeTable[otpSymbolMap[(uint8_t)plain[i]]][otpSymbolMap[(uint8_t)key[i]]];
+}
+
+static void decodeScalar(char* original, const char* cipher, const char* key, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i++)
+		original[i] = decodeTable[otpSymbolMap[(uint8_t)cipher[i]]][otpSymbolMap[(uint8_t)key[i]]];
+}
+
+static size_t validateScalar(const char* text, size_t len)
+{
+	const uint8_t* bytes = (const uint8_t*)text;
+	size_t i = 0;
+
+	// OR the invalid flags of a whole block together, only looking closer
+	// at a block that turned out to hold a bad byte
+	for(; i + 64 <= len; i += 64)
+	{
+		uint8_t bad = 0;
+		size_t j;
+		for(j = 0; j < 64; j++)
+			bad |= otpInvalidMap[bytes[i + j]];
+		if(bad)
+			break;
+	}
+
+	for(; i < len; i++)
+	{
+		if(otpInvalidMap[bytes[i]])
+			return i;
+	}
+	return len;
+}
+
+static void xorScalar(char* out, const char* text, const char* key, size_t len)
+{
+	size_t i = 0;
+
+	// a word at a time, memcpy compiles down to plain unaligned loads
+	for(; i + 8 <= len; i += 8)
+	{
+		uint64_t t, k;
+		memcpy(&t, text + i, 8);
+		memcpy(&k, key + i, 8);
+		t ^= k;
+		memcpy(out + i, &t, 8);
+	}
+	for(; i < len; i++)
+		out[i] = text[i] ^ key[i];
+}
+
+#ifdef OTP_X86
+
+/* SSE2: 16 symbols per vector, two vectors per iteration */
+
+__attribute__((target("sse2")))
+static inline __m128i toSymbolSSE2(__m128i c)
+{
+	return _mm_min_epu8(_mm_sub_epi8(c, _mm_set1_epi8('A')), _mm_set1_epi8(26));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i fromSymbolSSE2(__m128i sym)
+{
+	__m128i isSpace = _mm_cmpeq_epi8(sym, _mm_set1_epi8(26));
+	return _mm_sub_epi8(_mm_add_epi8(sym, _mm_set1_epi8('A')),
+			_mm_and_si128(isSpace, _mm_set1_epi8(OTP_SPACE_GAP)));
+}
+
+__attribute__((target("sse2")))
+static inline __m128i encodeSSE2Step(const char* plain, const char* key)
+{
+	__m128i p = toSymbolSSE2(_mm_loadu_si128((const __m128i*)plain));
+	__m128i k = toSymbolSSE2(_mm_loadu_si128((const __m128i*)key));
+	__m128i sum = _mm_add_epi8(p, k);
+	sum = _mm_min_epu8(sum, _mm_sub_epi8(sum, _mm_set1_epi8(27)));
+	return fromSymbolSSE2(sum);
+}
+
+__attribute__((target("sse2")))
+static inline __m128i decodeSSE2Step(const char* cipher, const char* key)
+{
+	__m128i c = toSymbolSSE2(_mm_loadu_si128((const __m128i*)cipher));
+	__m128i k = toSymbolSSE2(_mm_loadu_si128((const __m128i*)key));
+	__m128i diff = _mm_add_epi8(_mm_sub_epi8(c, k), _mm_set1_epi8(27));
+	diff = _mm_min_epu8(diff, _mm_sub_epi8(diff, _mm_set1_epi8(27)));
+	return fromSymbolSSE2(diff);
+}
+
+__attribute__((target("sse2")))
+static void encodeSSE2(char* cipher, const char* plain, const char* key, size_t len)
+{
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m128i lo = encodeSSE2Step(plain + i, key + i);
+		__m128i hi = encodeSSE2Step(plain + i + 16, key + i + 16);
+		_mm_storeu_si128((__m128i*)(cipher + i), lo);
+		_mm_storeu_si128((__m128i*)(cipher + i + 16), hi);
+	}
+	for(; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i*)(cipher + i), encodeSSE2Step(plain + i, key + i));
+
+	encodeScalar(cipher + i, plain + i, key + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void decodeSSE2(char* original, const char* cipher, const char* key, size_t len)
+{
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m128i lo = decodeSSE2Step(cipher + i, key + i);
+		__m128i hi = decodeSSE2Step(cipher + i + 16, key + i + 16);
+		_mm_storeu_si128((__m128i*)(original + i), lo);
+		_mm_storeu_si128((__m128i*)(original + i + 16), hi);
+	}
+	for(; i + 16 <= len; i += 16)
+		_mm_storeu_si128((__m128i*)(original + i), decodeSSE2Step(cipher + i, key + i));
+
+	decodeScalar(original + i, cipher + i, key + i, len - i);
+}
+
+// 0xffff when all 16 bytes are 'A'-'Z' or space, else a bit clear for each one that is not
+__attribute__((target("sse2")))
+static inline int validMaskSSE2(__m128i c)
+{
+	__m128i letter = _mm_sub_epi8(c, _mm_set1_epi8('A'));
+	__m128i isLetter = _mm_cmpeq_epi8(_mm_min_epu8(letter, _mm_set1_epi8(25)), letter);
+	__m128i isSpace = _mm_cmpeq_epi8(c, _mm_set1_epi8(' '));
+	return _mm_movemask_epi8(_mm_or_si128(isLetter, isSpace));
+}
+
+__attribute__((target("sse2")))
+static size_t validateSSE2(const char* text, size_t len)
+{
+	size_t i = 0;
+
+	// AND the masks of a whole block, only looking closer at one with a bad byte
+	for(; i + 64 <= len; i += 64)
+	{
+		__m128i a = _mm_loadu_si128((const __m128i*)(text + i));
+		__m128i b = _mm_loadu_si128((const __m128i*)(text + i + 16));
+		__m128i c = _mm_loadu_si128((const __m128i*)(text + i + 32));
+		__m128i d = _mm_loadu_si128((const __m128i*)(text + i + 48));
+		if((validMaskSSE2(a) & validMaskSSE2(b) & validMaskSSE2(c) & validMaskSSE2(d)) != 0xffff)
+			break;
+	}
+	for(; i + 16 <= len; i += 16)
+	{
+		int valid = validMaskSSE2(_mm_loadu_si128((const __m128i*)(text + i)));
+		if(valid != 0xffff)
+			return i + __builtin_ctz(~valid);
+	}
+	return i + validateScalar(text + i, len - i);
+}
+
+__attribute__((target("sse2")))
+static void xorSSE2(char* out, const char* text, const char* key, size_t len)
+{
+	size_t i = 0;
+	for(; i + 32 <= len; i += 32)
+	{
+		__m128i lo = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(text + i)), _mm_loadu_si128((const __m128i*)(key + i)));
+		__m128i hi = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(text + i + 16)), _mm_loadu_si128((const __m128i*)(key + i + 16)));
+		_mm_storeu_si128((__m128i*)(out + i), lo);
+		_mm_storeu_si128((__m128i*)(out + i + 16), hi);
+	}
+	xorScalar(out + i, text + i, key + i, len - i);
+}
+
+/* AVX2: 32 symbols per vector, two vectors per iteration */
+
+__attribute__((target("avx2")))
+static inline __m256i toSymbolAVX2(__m256i c)
+{
+	return _mm256_min_epu8(_mm256_sub_epi8(c, _mm256_set1_epi8('A')), _mm256_set1_epi8(26));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i fromSymbolAVX2(__m256i sym)
+{
+	__m256i isSpace = _mm256_cmpeq_epi8(sym, _mm256_set1_epi8(26));
+	return _mm256_sub_epi8(_mm256_add_epi8(sym, _mm256_set1_epi8('A')),
+			_mm256_and_si256(isSpace, _mm256_set1_epi8(OTP_SPACE_GAP)));
+}
+
+__attribute__((target("avx2")))
+static inline __m256i encodeAVX2Step(const char* plain, const char* key)
+{
+	__m256i p = toSymbolAVX2(_mm256_loadu_si256((const __m256i*)plain));
+	__m256i k = toSymbolAVX2(_mm256_loadu_si256((const __m256i*)key));
+	__m256i sum = _mm256_add_epi8(p, k);
+	sum = _mm256_min_epu8(sum, _mm256_sub_epi8(sum, _mm256_set1_epi8(27)));
+	return fromSymbolAVX2(sum);
+}
+
+__attribute__((target("avx2")))
+static inline __m256i decodeAVX2Step(const char* cipher, const char* key)
+{
+	__m256i c = toSymbolAVX2(_mm256_loadu_si256((const __m256i*)cipher));
+	__m256i k = toSymbolAVX2(_mm256_loadu_si256((const __m256i*)key));
+	__m256i diff = _mm256_add_epi8(_mm256_sub_epi8(c, k), _mm256_set1_epi8(27));
+	diff = _mm256_min_epu8(diff, _mm256_sub_epi8(diff, _mm256_set1_epi8(27)));
+	return fromSymbolAVX2(diff);
+}
+
+__attribute__((target("avx2")))
+static void encodeAVX2(char* cipher, const char* plain, const char* key, size_t len)
+{
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+	{
+		__m256i lo = encodeAVX2Step(plain + i, key + i);
+		__m256i hi = encodeAVX2Step(plain + i + 32, key + i + 32);
+		_mm256_storeu_si256((__m256i*)(cipher + i), lo);
+		_mm256_storeu_si256((__m256i*)(cipher + i + 32), hi);
+	}
+	for(; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i*)(cipher + i), encodeAVX2Step(plain + i, key + i));
+
+	encodeScalar(cipher + i, plain + i, key + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void decodeAVX2(char* original, const char* cipher, const char* key, size_t len)
+{
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+	{
+		__m256i lo = decodeAVX2Step(cipher + i, key + i);
+		__m256i hi = decodeAVX2Step(cipher + i + 32, key + i + 32);
+		_mm256_storeu_si256((__m256i*)(original + i), lo);
+		_mm256_storeu_si256((__m256i*)(original + i + 32), hi);
+	}
+	for(; i + 32 <= len; i += 32)
+		_mm256_storeu_si256((__m256i*)(original + i), decodeAVX2Step(cipher + i, key + i));
+
+	decodeScalar(original + i, cipher + i, key + i, len - i);
+}
+
+// all ones when all 32 bytes are 'A'-'Z' or space, else a bit clear for each one that is not
+__attribute__((target("avx2")))
+static inline uint32_t validMaskAVX2(__m256i c)
+{
+	__m256i letter = _mm256_sub_epi8(c, _mm256_set1_epi8('A'));
+	__m256i isLetter = _mm256_cmpeq_epi8(_mm256_min_epu8(letter, _mm256_set1_epi8(25)), letter);
+	__m256i isSpace = _mm256_cmpeq_epi8(c, _mm256_set1_epi8(' '));
+	return (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(isLetter, isSpace));
+}
+
+__attribute__((target("avx2")))
+static size_t validateAVX2(const char* text, size_t len)
+{
+	size_t i = 0;
+
+	// AND the masks of a whole block, only looking closer at one with a bad byte
+	for(; i + 128 <= len; i += 128)
+	{
+		__m256i a = _mm256_loadu_si256((const __m256i*)(text + i));
+		__m256i b = _mm256_loadu_si256((const __m256i*)(text + i + 32));
+		__m256i c = _mm256_loadu_si256((const __m256i*)(text + i + 64));
+		__m256i d = _mm256_loadu_si256((const __m256i*)(text + i + 96));
+		if((validMaskAVX2(a) & validMaskAVX2(b) & validMaskAVX2(c) & validMaskAVX2(d)) != UINT32_MAX)
+			break;
+	}
+	for(; i + 32 <= len; i += 32)
+	{
+		uint32_t valid = validMaskAVX2(_mm256_loadu_si256((const __m256i*)(text + i)));
+		if(valid != UINT32_MAX)
+			return i + __builtin_ctz(~valid);
+	}
+	return i + validateScalar(text + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static void xorAVX2(char* out, const char* text, const char* key, size_t len)
+{
+	size_t i = 0;
+	for(; i + 64 <= len; i += 64)
+	{
+		__m256i lo = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(text + i)), _mm256_loadu_si256((const __m256i*)(key + i)));
+		__m256i hi = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(text + i + 32)), _mm256_loadu_si256((const __m256i*)(key + i + 32)));
+		_mm256_storeu_si256((__m256i*)(out + i), lo);
+		_mm256_storeu_si256((__m256i*)(out + i + 32), hi);
+	}
+	xorScalar(out + i, text + i, key + i, len - i);
+}
+
+/* AVX-512BW: 64 symbols per vector, masked loads and stores cover the tail */
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i toSymbolAVX512(__m512i c)
+{
+	return _mm512_min_epu8(_mm512_sub_epi8(c, _mm512_set1_epi8('A')), _mm512_set1_epi8(26));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __m512i fromSymbolAVX512(__m512i sym)
+{
+	__mmask64 isSpace = _mm512_cmpeq_epi8_mask(sym, _mm512_set1_epi8(26));
+	__m512i c = _mm512_add_epi8(sym, _mm512_set1_epi8('A'));
+	return _mm512_mask_sub_epi8(c, isSpace, c, _mm512_set1_epi8(OTP_SPACE_GAP));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void encodeAVX512(char* cipher, const char* plain, const char* key, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i += 64)
+	{
+		// all ones for full vectors, low (len - i) bits for the tail
+		__mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+		__m512i p = toSymbolAVX512(_mm512_maskz_loadu_epi8(m, plain + i));
+		__m512i k = toSymbolAVX512(_mm512_maskz_loadu_epi8(m, key + i));
+		__m512i sum = _mm512_add_epi8(p, k);
+		sum = _mm512_min_epu8(sum, _mm512_sub_epi8(sum, _mm512_set1_epi8(27)));
+		_mm512_mask_storeu_epi8(cipher + i, m, fromSymbolAVX512(sum));
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void decodeAVX512(char* original, const char* cipher, const char* key, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i += 64)
+	{
+		__mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+		__m512i c = toSymbolAVX512(_mm512_maskz_loadu_epi8(m, cipher + i));
+		__m512i k = toSymbolAVX512(_mm512_maskz_loadu_epi8(m, key + i));
+		__m512i diff = _mm512_add_epi8(_mm512_sub_epi8(c, k), _mm512_set1_epi8(27));
+		diff = _mm512_min_epu8(diff, _mm512_sub_epi8(diff, _mm512_set1_epi8(27)));
+		_mm512_mask_storeu_epi8(original + i, m, fromSymbolAVX512(diff));
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static size_t validateAVX512(const char* text, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i += 64)
+	{
+		__mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+		__m512i c = _mm512_maskz_loadu_epi8(m, text + i);
+		__mmask64 isLetter = _mm512_cmple_epu8_mask(_mm512_sub_epi8(c, _mm512_set1_epi8('A')), _mm512_set1_epi8(25));
+		__mmask64 isSpace = _mm512_cmpeq_epi8_mask(c, _mm512_set1_epi8(' '));
+		__mmask64 invalid = ~(isLetter | isSpace) & m;
+		if(invalid)
+			return i + __builtin_ctzll(invalid);
+	}
+	return len;
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void xorAVX512(char* out, const char* text, const char* key, size_t len)
+{
+	size_t i;
+	for(i = 0; i < len; i += 64)
+	{
+		__mmask64 m = (len - i >= 64) ? ~(__mmask64)0 : (((__mmask64)1 << (len - i)) - 1);
+		__m512i t = _mm512_maskz_loadu_epi8(m, text + i);
+		__m512i k = _mm512_maskz_loadu_epi8(m, key + i);
+		_mm512_mask_storeu_epi8(out + i, m, _mm512_xor_si512(t, k));
+	}
+}
+
+#endif
+
+// one entry per kernel, ordered from widest to narrowest
+struct otpKernel
+{
+	const char* name;
+	int (*supported)();
+	void (*encode)(char*, const char*, const char*, size_t);
+	void (*decode)(char*, const char*, const char*, size_t);
+	size_t (*validate)(const char*, size_t);
+	void (*xor)(char*, const char*, const char*, size_t);
+};
+
+#ifdef OTP_X86
+static int hasAVX512() { return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"); }
+static int hasAVX2() { return __builtin_cpu_supports("avx2"); }
+static int hasSSE2() { return __builtin_cpu_supports("sse2"); }
+#endif
+static int hasScalar() { return 1; }
+
+static const struct otpKernel kernels[] =
+{
+#ifdef OTP_X86
+	{ "avx512", hasAVX512, encodeAVX512, decodeAVX512, validateAVX512, xorAVX512 },
+	{ "avx2", hasAVX2, encodeAVX2, decodeAVX2, validateAVX2, xorAVX2 },
+	{ "sse2", hasSSE2, encodeSSE2, decodeSSE2, validateSSE2, xorSSE2 },
+#endif
+	{ "scalar", hasScalar, encodeScalar, decodeScalar, validateScalar, xorScalar },
+};
+
+// selected kernel, scalar until otpCodecInit() runs
+static const struct otpKernel* active = &kernels[sizeof(kernels) / sizeof(kernels[0]) - 1];
+
+void otpCodecInit()
+{
+	const char* forced = getenv("OTP_CODEC");
+	size_t i;
+
+#ifdef OTP_X86
+	__builtin_cpu_init();
+#endif
+
+	for(i = 0; i < sizeof(kernels) / sizeof(kernels[0]); i++)
+	{
+		// skip kernels the CPU lacks, or that were not asked for
+		if(!kernels[i].supported())
+			continue;
+		if(forced != NULL && strcmp(forced, kernels[i].name) != 0)
+			continue;
+
+		active = &kernels[i];
+		return;
+	}
+}
+
+const char* otpCodecName()
+{
+	return active->name;
+}
+
+void otpEncode(char* cipher, const char* plain, const char* key, size_t len)
+{
+	active->encode(cipher, plain, key, len);
+}
+
+void otpDecode(char* original, const char* cipher, const char* key, size_t len)
+{
+	active->decode(original, cipher, key, len);
+}
+
+size_t otpValidate(const char* text, size_t len)
+{
+	return active->validate(text, len);
+}
+
+void otpXor(char* out, const char* text, const char* key, size_t len)
+{
+	active->xor(out, text, key, len);
+}
@@ -0,0 +1,43 @@
+#ifndef OTP_CODEC_H
+#define OTP_CODEC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Mod-27 codec (libotp) shared by all five programs.
+// Symbols are 'A'-'Z' (0-25) and space (26). Any other byte is treated
+// as a space, identically by every kernel, so output never depends on
+// which variant the CPU selected.
+
+// symbol (0-26) for every byte value, anything outside 'A'-'Z' maps to 26
+extern const uint8_t otpSymbolMap[256];
+
+// 1 for every byte that is not 'A'-'Z' or space
+extern const uint8_t otpInvalidMap[256];
+
+// character for every symbol, 26 is the space
+extern const char otpSymbolChar[27];
+
+// picks the widest kernel the CPU supports (cpuid), call once at startup
+// setting OTP_CODEC=scalar|sse2|avx2|avx512 in the environment forces a variant
+void otpCodecInit();
+
+// name of the selected kernel, for logging
+const char* otpCodecName();
+
+// cipher[i] = (plain[i] + key[i]) mod 27, for len symbols
+void otpEncode(char* cipher, const char* plain, const char* key, size_t len);
+
+// original[i] = (cipher[i] - key[i]) mod 27, for len symbols
+void otpDecode(char* original, const char* cipher, const char* key, size_t len);
+
+// returns the offset of the first byte that is not 'A'-'Z' or space,
+// or len if the whole buffer is valid. A newline stops it like any other
+// byte, so one call finds both where a line ends and any bad byte in it
+size_t otpValidate(const char* text, size_t len);
+
+// out[i] = text[i] ^ key[i], for len bytes of any value: binary mode,
+// where the pad is raw random bytes and XOR is its own inverse
+void otpXor(char* out, const char* text, const char* key, size_t len);
+
+#endif
@@ -0,0 +1,798 @@
+#include <stdlib.h>
+#include <string.h>
+#include "otp_codec.h"
+#include "otp_conn.h"
+
+// store string values for accept and deny responses to the handshake
+static const char handshakeAccept = '1';
+static const char handshakeDeny = '0';
+
+// buffers grown past this for one large request are released when it
+// ends, so a persistent connection does not pin that memory
+#define OTP_KEEP_CAPACITY (1024 * 1024)
+
+// legacy clients send every package in 1024 byte blocks, so the next
+// package starts on the following 1024 byte boundary
+#define OTP_LEGACY_BLOCK 1024
+
+// framed input is received a batch at a time into a staging buffer of
+// this size and taken apart there, so a recv can cover many small frames;
+// the rest of a payload of OTP_STAGE_PAYLOAD_MAX bytes or more is read
+// straight into its destination instead. Large payloads come in
+// runs (a streamed request's chunks), so the header after one is read on
+// its own, leaving the next payload to be read in place too
+#define OTP_STAGING_SIZE (64 * 1024)
+#define OTP_STAGE_PAYLOAD_MAX (4 * 1024)
+
+// forward declarations
+static int handshakeVerify(struct otpConnection* conn);
+static int turnAway(struct otpConnection* conn);
+static void charge(struct otpConnection* conn);
+static int selectService(struct otpConnection* conn, uint32_t handshakeId);
+static int beginFrame(struct otpConnection* conn);
+static int finishFrame(struct otpConnection* conn);
+static int queueFrame(struct otpConnection* conn, int type, const char* payload, size_t length);
+static int queueFlaggedFrame(struct otpConnection* conn, int type, int flags, const char* payload, size_t length);
+static int joinRequest(struct otpConnection* conn);
+static void endRequest(struct otpConnection* conn);
+static int referencePad(struct otpConnection* conn);
+static int beginChunk(struct otpConnection* conn, struct otpBuffer* buffer, size_t* start);
+static int transformStream(struct otpConnection* conn);
+static size_t legacyLimit(struct otpConnection* conn);
+static size_t stagingWindow(struct otpConnection* conn, char** window);
+static int finishRequest(struct otpConnection* conn);
+static char* reserveOutput(struct otpConnection* conn, size_t n);
+static void transform(struct otpConnection* conn, char* out, const char* text, const char* key, size_t length);
+static void measureHandshake(struct otpConnection* conn, int accepted);
+static void measureRequest(struct otpConnection* conn);
+
+void otpConnReset(struct otpConnection* conn, const struct otpService* service, const struct otpServerConfig* config,
+	struct otpMetrics* metrics, int fd)
+{
+	conn->fd = fd;
+	conn->state = CONN_HANDSHAKE;
+	conn->service = service;
+	conn->config = config;
+	conn->idLength = 0;
+	conn->text.length = 0;
+	conn->key.length = 0;
+	conn->padLeft = 0;
+	conn->headerLength = 0;
+	conn->frame.length = 0;
+	conn->payloadGot = 0;
+	conn->accepted = 0;
+	conn->binary = 0;
+	conn->haveText = 0;
+	conn->streaming = 0;
+	conn->request = 0;
+	conn->refKey = NULL;
+	conn->refKeyLeft = 0;
+	conn->textStart = 0;
+	conn->keyStart = 0;
+	conn->out.length = 0;
+	conn->outSent = 0;
+	conn->metrics = metrics;
+	conn->phaseStart = (metrics != NULL) ? otpMetricsNow() : 0;
+	conn->transformNs = 0;
+	conn->sendStart = 0;
+	conn->load = NULL;
+	conn->busy = 0;
+	conn->charged = 0;
+	conn->events = 0;
+}
+
+void otpConnAdmit(struct otpConnection* conn, struct otpLoad* load)
+{
+	const struct otpServerConfig* config = conn->config;
+
+	conn->load = load;
+	conn->busy = (config->maxConnections > 0 && load->connections >= config->maxConnections)
+		|| (config->maxInFlight > 0 && load->inFlight >= config->maxInFlight);
+	if(!conn->busy)
+		load->connections++;
+}
+
+void otpConnRelease(struct otpConnection* conn)
+{
+	if(conn->load == NULL)
+		return;
+	if(!conn->busy)
+		conn->load->connections--;
+	conn->load->inFlight -= conn->charged;
+	conn->charged = 0;
+	conn->load = NULL;
+}
+
+void otpConnFree(struct otpConnection* conn)
+{
+	otpBufferFree(&conn->text);
+	otpBufferFree(&conn->key);
+	otpBufferFree(&conn->out);
+	otpBufferFree(&conn->staging);
+}
+
+size_t otpConnWindow(struct otpConnection* conn, char** window)
+{
+	switch(conn->state)
+	{
+		case CONN_HANDSHAKE:
+			// a framed client's HELLO, and often its first request, arrive with the preamble
+			return stagingWindow(conn, window);
+
+		case CONN_RECV_TEXT:
+			// make room for at least one more block before reading
+			if(!otpBufferReserve(&conn->text, conn->text.length + OTP_LEGACY_BLOCK, legacyLimit(conn)))
+				return 0;
+			*window = conn->text.data + conn->text.length;
+			return conn->text.capacity - conn->text.length;
+
+		case CONN_SKIP_PAD:
+			// padding is read into the spare room of the text buffer and dropped
+			if(!otpBufferReserve(&conn->text, conn->text.length + OTP_LEGACY_BLOCK, legacyLimit(conn)))
+				return 0;
+			*window = conn->text.data + conn->text.length;
+			return conn->padLeft < conn->text.capacity - conn->text.length ? conn->padLeft : conn->text.capacity - conn->text.length;
+
+		case CONN_RECV_KEY:
+			// past the text's length this is scratch space, the rest of the key is dropped
+			if(!otpBufferReserve(&conn->key, conn->key.length + OTP_LEGACY_BLOCK, legacyLimit(conn)))
+				return 0;
+			*window = conn->key.data + conn->key.length;
+			return conn->key.capacity - conn->key.length;
+
+		case CONN_DRAIN:
+			// the text buffer doubles as a place to drop input
+			if(!otpBufferReserve(&conn->text, OTP_LEGACY_BLOCK, OTP_BUFFER_UNLIMITED))
+				return 0;
+			*window = conn->text.data;
+			return conn->text.capacity;
+
+		case CONN_FRAME_HEADER:
+			if(conn->frame.length >= OTP_STAGE_PAYLOAD_MAX)
+			{
+				*window = conn->header + conn->headerLength;
+				return OTP_HEADER_SIZE - conn->headerLength;
+			}
+			return stagingWindow(conn, window);
+
+		case CONN_FRAME_PAYLOAD:
+			// a small payload comes in with whatever frames follow it
+			if(conn->frame.length < OTP_STAGE_PAYLOAD_MAX)
+				return stagingWindow(conn, window);
+
+			// exactly the rest of this payload, so no bytes of the next frame land here
+			*window = conn->payload + conn->payloadGot;
+			return conn->frame.length - conn->payloadGot;
+
+		default:
+			*window = NULL;
+			return 0;
+	}
+}
+
+int otpConnFeed(struct otpConnection* conn, const char* data, size_t length)
+{
+	if(conn->metrics != NULL)
+		otpMetricAdd(&conn->metrics->bytesIn, length);
+
+	// a single read can cover the end of one package and the start of the
+	// next, so keep going until every byte has been assigned a state
+	while(length > 0)
+	{
+		size_t used;
+		const char* terminator;
+
+		switch(conn->state)
+		{
+			case CONN_HANDSHAKE:
+				used = sizeof(conn->id) - conn->idLength;
+				if(used > length)
+					used = length;
+				if(data != conn->id + conn->idLength)
+					memcpy(conn->id + conn->idLength, data, used);
+				conn->idLength += used;
+
+				// over an admission limit, the client is turned away before any work starts
+				if(conn->idLength == sizeof(conn->id) && conn->busy)
+				{
+					if(!turnAway(conn))
+						return 0;
+				}
+				// a framed client sends its id in a HELLO frame after the preamble
+				else if(conn->idLength == sizeof(conn->id) && memcmp(conn->id, otpPreamble, OTP_PREAMBLE_SIZE) == 0)
+					conn->state = CONN_FRAME_HEADER;
+				// the whole legacy id is in, accept or deny it
+				else if(conn->idLength == sizeof(conn->id) && !handshakeVerify(conn))
+					conn->state = CONN_CLOSING;
+				else if(conn->idLength == sizeof(conn->id))
+					conn->state = CONN_RECV_TEXT;
+				break;
+
+			case CONN_FRAME_HEADER:
+				used = OTP_HEADER_SIZE - conn->headerLength;
+				if(used > length)
+					used = length;
+				if(data != conn->header + conn->headerLength)
+					memcpy(conn->header + conn->headerLength, data, used);
+				conn->headerLength += used;
+
+				if(conn->headerLength == OTP_HEADER_SIZE && !beginFrame(conn))
+					return 0;
+				break;
+
+			case CONN_FRAME_PAYLOAD:
+				used = conn->frame.length - conn->payloadGot;
+				if(used > length)
+					used = length;
+				if(data != conn->payload + conn->payloadGot)
+					memcpy(conn->payload + conn->payloadGot, data, used);
+				conn->payloadGot += used;
+
+				if(conn->payloadGot == conn->frame.length && !finishFrame(conn))
+					return 0;
+				break;
+
+			case CONN_RECV_TEXT:
+				// everything before the '?' belongs to the text
+				terminator = memchr(data, '?', length);
+				used = (terminator != NULL) ? (size_t)(terminator - data) : length;
+				if(!otpBufferAppend(&conn->text, data, used, conn->config->packageLimit))
+					return 0;
+
+				// package complete, skip the rest of its last block
+				if(terminator != NULL)
+				{
+					used++;
+					conn->padLeft = OTP_LEGACY_BLOCK - 1 - (conn->text.length % OTP_LEGACY_BLOCK);
+					conn->state = (conn->padLeft > 0) ? CONN_SKIP_PAD : CONN_RECV_KEY;
+				}
+				break;
+
+			case CONN_SKIP_PAD:
+				used = (conn->padLeft < length) ? conn->padLeft : length;
+				conn->padLeft -= used;
+				if(conn->padLeft == 0)
+					conn->state = CONN_RECV_KEY;
+				break;
+
+			case CONN_RECV_KEY:
+				terminator = memchr(data, '?', length);
+				used = (terminator != NULL) ? (size_t)(terminator - data) : length;
+
+				// legacy clients send the whole key file; only keep what the text needs
+				if(used > conn->text.length - conn->key.length)
+					used = conn->text.length - conn->key.length;
+				if(!otpBufferAppend(&conn->key, data, used, conn->config->packageLimit))
+					return 0;
+
+				// both packages are in, transform and queue the result
+				if(terminator != NULL)
+				{
+					if(conn->key.length < conn->text.length || !finishRequest(conn))
+						return 0;
+					measureRequest(conn);
+					conn->state = CONN_CLOSING;
+				}
+				used = length;	// anything after the key is the client's padding
+				break;
+
+			default:
+				// nothing more is expected, drop it
+				used = length;
+				break;
+		}
+
+		data += used;
+		length -= used;
+	}
+	charge(conn);
+	return 1;
+}
+
+int otpConnReadable(struct otpConnection* conn)
+{
+	return conn->state != CONN_CLOSING && conn->out.length - conn->outSent < OTP_STREAM_WINDOW;
+}
+
+size_t otpConnPending(struct otpConnection* conn, const char** data)
+{
+	*data = conn->out.data + conn->outSent;
+	return conn->out.length - conn->outSent;
+}
+
+void otpConnSent(struct otpConnection* conn, size_t length)
+{
+	conn->outSent += length;
+	if(conn->metrics != NULL)
+		otpMetricAdd(&conn->metrics->bytesOut, length);
+
+	// all out, start the buffer over
+	if(conn->outSent == conn->out.length)
+	{
+		conn->outSent = conn->out.length = 0;
+		if(conn->sendStart != 0)
+		{
+			otpHistogramRecord(&conn->metrics->phases[OTP_PHASE_SEND], otpMetricsNow() - conn->sendStart);
+			conn->sendStart = 0;
+		}
+	}
+	charge(conn);
+}
+
+int otpConnFinished(struct otpConnection* conn)
+{
+	return conn->state == CONN_CLOSING && conn->out.length == 0;
+}
+
+unsigned int otpConnTimeout(struct otpConnection* conn)
+{
+	if(conn->out.length > conn->outSent)
+		return conn->config->writeTimeout;
+	if(conn->accepted && conn->state == CONN_FRAME_HEADER && conn->headerLength == 0 && !conn->haveText && !conn->streaming && conn->refKey == NULL)
+		return conn->config->idleTimeout;
+	return conn->config->readTimeout;
+}
+
+// verifies who is connected (otp_enc, otp_dec) and queues the response
+// returns 1 if handshake was accepted, 0 otherwise
+static int handshakeVerify(struct otpConnection* conn)
+{
+	char buffer[sizeof(conn->id) + 1];
+	memcpy(buffer, conn->id, sizeof(conn->id));
+	buffer[sizeof(conn->id)] = '\0';
+
+	// convert id to integer and check it matches a service
+	int u_id = atoi(buffer);
+	int accepted = (u_id >= 0 && selectService(conn, (uint32_t)u_id));
+
+	char* response = reserveOutput(conn, 1);
+	if(response == NULL)
+		return 0;
+	*response = accepted ? handshakeAccept : handshakeDeny;
+	measureHandshake(conn, accepted);
+	return accepted;
+}
+
+// Answers a client that arrived over an admission limit: a framed client
+// gets BUSY, and its HELLO is drained so it reads that rather than a reset;
+// a legacy client has no such answer and is just closed
+// returns 0 if memory ran out
+static int turnAway(struct otpConnection* conn)
+{
+	if(conn->metrics != NULL)
+		otpMetricAdd(&conn->metrics->busy, 1);
+
+	if(memcmp(conn->id, otpPreamble, OTP_PREAMBLE_SIZE) != 0)
+	{
+		conn->state = CONN_CLOSING;
+		return 1;
+	}
+	if(!queueFrame(conn, OTP_FRAME_BUSY, NULL, 0))
+		return 0;
+	conn->state = CONN_DRAIN;
+	return 1;
+}
+
+// Picks the service the client's id belongs to out of those the daemon
+// chains together (conn->service is the first until the handshake)
+// returns 0 if none of them accepts it
+static int selectService(struct otpConnection* conn, uint32_t handshakeId)
+{
+	const struct otpService* service;
+	for(service = conn->service; service != NULL; service = service->next)
+	{
+		if((uint32_t)service->handshakeId == handshakeId)
+		{
+			conn->service = service;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// Checks a complete frame header and points the payload at its destination
+// returns 0 if the frame is not allowed here
+static int beginFrame(struct otpConnection* conn)
+{
+	otpUnpackHeader(conn->header, &conn->frame);
+	conn->headerLength = 0;
+	conn->payloadGot = 0;
+
+	switch(conn->frame.type)
+	{
+		case OTP_FRAME_HELLO:
+			// exactly once, before anything else, carrying the 4 byte id
+			if(conn->accepted || conn->frame.length != sizeof(conn->id))
+				return 0;
+			conn->payload = conn->id;
+			break;
+
+		case OTP_FRAME_TEXT:
+			if(!conn->accepted || conn->haveText || conn->streaming || !joinRequest(conn))
+				return 0;
+			if(conn->frame.length > conn->config->packageLimit)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Message is too long.", strlen("Message is too long."));
+			if(conn->refKey != NULL && conn->frame.length > conn->refKeyLeft)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Key length is too short.", strlen("Key length is too short."));
+
+			// the length is known up front, so allocate once and read straight into it
+			if(!otpBufferReserve(&conn->text, conn->frame.length, conn->config->packageLimit))
+				return queueFrame(conn, OTP_FRAME_ERROR, "Not enough memory for message.", strlen("Not enough memory for message."));
+			conn->payload = conn->text.data;
+			conn->text.length = conn->frame.length;
+			break;
+
+		case OTP_FRAME_KEY:
+			if(!conn->haveText || conn->refKey != NULL || !joinRequest(conn))
+				return 0;
+			if(conn->frame.length < conn->text.length)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Key length is too short.", strlen("Key length is too short."));
+			if(conn->frame.length > conn->config->packageLimit)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Key is too long.", strlen("Key is too long."));
+
+			if(!otpBufferReserve(&conn->key, conn->frame.length, conn->config->packageLimit))
+				return queueFrame(conn, OTP_FRAME_ERROR, "Not enough memory for key.", strlen("Not enough memory for key."));
+			conn->payload = conn->key.data;
+			conn->key.length = conn->frame.length;
+			break;
+
+		case OTP_FRAME_TEXT_CHUNK:
+			if(!conn->accepted || conn->haveText || !joinRequest(conn))
+				return 0;
+			if(conn->refKey != NULL && conn->frame.length > conn->refKeyLeft)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Key length is too short.", strlen("Key length is too short."));
+			if(!beginChunk(conn, &conn->text, &conn->textStart))
+				return queueFrame(conn, OTP_FRAME_ERROR, "Text and key chunks must alternate.", strlen("Text and key chunks must alternate."));
+			break;
+
+		case OTP_FRAME_KEY_CHUNK:
+			if(!conn->accepted || conn->haveText || conn->refKey != NULL || !joinRequest(conn))
+				return 0;
+			if(!beginChunk(conn, &conn->key, &conn->keyStart))
+				return queueFrame(conn, OTP_FRAME_ERROR, "Text and key chunks must alternate.", strlen("Text and key chunks must alternate."));
+			break;
+
+		case OTP_FRAME_END:
+			if(!conn->streaming || conn->frame.length != 0 || !joinRequest(conn))
+				return 0;
+			break;
+
+		case OTP_FRAME_KEY_REF:
+			// opens a request, carrying an offset and a pad name
+			if(!conn->accepted || conn->haveText || conn->streaming || conn->refKey != NULL || !joinRequest(conn))
+				return 0;
+			if(conn->frame.length <= OTP_KEY_REF_OFFSET_SIZE || conn->frame.length > sizeof(conn->reference))
+				return 0;
+			if(conn->binary)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Pads cannot be used in binary mode.", strlen("Pads cannot be used in binary mode."));
+			conn->payload = conn->reference;
+			break;
+
+		default:
+			return 0;
+	}
+
+	conn->state = CONN_FRAME_PAYLOAD;
+
+	// nothing to read for an empty payload
+	if(conn->frame.length == 0)
+		return finishFrame(conn);
+	return 1;
+}
+
+// Acts on a frame whose payload has fully arrived
+// returns 0 if the connection should be dropped
+static int finishFrame(struct otpConnection* conn)
+{
+	conn->state = CONN_FRAME_HEADER;
+
+	switch(conn->frame.type)
+	{
+		case OTP_FRAME_HELLO:
+			// check the id against the services and answer with ACCEPT or DENY;
+			// ACCEPT grants whichever of the asked for modes this daemon knows
+			conn->accepted = selectService(conn, otpUnpack32(conn->id));
+			measureHandshake(conn, conn->accepted);
+			if(!conn->accepted)
+			{
+				if(!queueFrame(conn, OTP_FRAME_DENY, NULL, 0))
+					return 0;
+				conn->state = CONN_CLOSING;
+				return 1;
+			}
+			conn->binary = (conn->frame.flags & OTP_HELLO_BINARY) != 0;
+			return queueFlaggedFrame(conn, OTP_FRAME_ACCEPT, conn->frame.flags & OTP_HELLO_BINARY, NULL, 0);
+
+		case OTP_FRAME_TEXT:
+			conn->haveText = 1;
+
+			// with a pad there is no KEY frame, the result can go out now
+			if(conn->refKey != NULL)
+			{
+				if(!finishRequest(conn))
+					return 0;
+				endRequest(conn);
+			}
+			return 1;
+
+		case OTP_FRAME_KEY:
+			// both halves are in, transform and send the result
+			if(!finishRequest(conn))
+				return 0;
+			endRequest(conn);
+			return 1;
+
+		case OTP_FRAME_TEXT_CHUNK:
+		case OTP_FRAME_KEY_CHUNK:
+			// send back whatever both halves now cover
+			return transformStream(conn);
+
+		case OTP_FRAME_END:
+			// every text symbol needs a key symbol
+			if(conn->text.length - conn->textStart > 0)
+				return queueFrame(conn, OTP_FRAME_ERROR, "Key length is too short.", strlen("Key length is too short."));
+			if(!queueFrame(conn, OTP_FRAME_END, NULL, 0))
+				return 0;
+			endRequest(conn);
+			return 1;
+
+		case OTP_FRAME_KEY_REF:
+			return referencePad(conn);
+	}
+	return 0;
+}
+
+// Ties the frame just read to a request: the first frame of a request
+// picks its id, every later frame must carry the same one
+// returns 0 if the frame belongs to some other request
+static int joinRequest(struct otpConnection* conn)
+{
+	if(!conn->haveText && !conn->streaming && conn->refKey == NULL)
+	{
+		conn->request = conn->frame.request;
+		if(conn->metrics != NULL)
+			conn->phaseStart = otpMetricsNow();
+		return 1;
+	}
+	return conn->frame.request == conn->request;
+}
+
+// Forgets the finished request so the connection can take the next one
+static void endRequest(struct otpConnection* conn)
+{
+	measureRequest(conn);
+	conn->haveText = 0;
+	conn->streaming = 0;
+	conn->textStart = 0;
+	conn->keyStart = 0;
+	conn->text.length = 0;
+	conn->key.length = 0;
+	conn->refKey = NULL;
+	conn->refKeyLeft = 0;
+
+	if(conn->text.capacity > OTP_KEEP_CAPACITY)
+		otpBufferFree(&conn->text);
+	if(conn->key.capacity > OTP_KEEP_CAPACITY)
+		otpBufferFree(&conn->key);
+}
+
+// Looks up the pad a KEY_REF names and makes it this request's key
+// returns 0 if memory ran out
+static int referencePad(struct otpConnection* conn)
+{
+	const char* name = conn->reference + OTP_KEY_REF_OFFSET_SIZE;
+	size_t nameLength = conn->frame.length - OTP_KEY_REF_OFFSET_SIZE;
+	uint64_t offset = otpUnpack64(conn->reference);
+
+	const struct otpPad* pad = otpPadFind(&conn->config->pads, name, nameLength);
+	if(pad == NULL)
+		return queueFrame(conn, OTP_FRAME_ERROR, "Unknown pad.", strlen("Unknown pad."));
+	if(offset > pad->length)
+		return queueFrame(conn, OTP_FRAME_ERROR, "Pad offset is past the end of the pad.", strlen("Pad offset is past the end of the pad."));
+
+	conn->refKey = pad->data + offset;
+	conn->refKeyLeft = pad->length - offset;
+	return 1;
+}
+
+// Points the payload of a TEXT_CHUNK / KEY_CHUNK at the end of its window,
+// first sliding the untransformed rest to the front. Returns 0 if the
+// chunk is too long or would overrun the window
+static int beginChunk(struct otpConnection* conn, struct otpBuffer* buffer, size_t* start)
+{
+	if(conn->frame.length > OTP_CHUNK_SIZE)
+		return 0;
+
+	// the window is allocated once and reused for the whole stream
+	if(!otpBufferReserve(buffer, OTP_STREAM_WINDOW, OTP_STREAM_WINDOW))
+		return 0;
+	if(*start > 0)
+	{
+		memmove(buffer->data, buffer->data + *start, buffer->length - *start);
+		buffer->length -= *start;
+		*start = 0;
+	}
+	if(buffer->length + conn->frame.length > OTP_STREAM_WINDOW)
+		return 0;
+
+	conn->streaming = 1;
+	conn->payload = buffer->data + buffer->length;
+	buffer->length += conn->frame.length;
+	return 1;
+}
+
+// Transforms as much as both the text and key windows hold into a
+// RESULT_CHUNK frame. Returns 0 if memory ran out
+static int transformStream(struct otpConnection* conn)
+{
+	size_t textPending = conn->text.length - conn->textStart;
+	size_t keyPending = (conn->refKey != NULL) ? conn->refKeyLeft : conn->key.length - conn->keyStart;
+	size_t length = (textPending < keyPending) ? textPending : keyPending;
+	const char* key = (conn->refKey != NULL) ? conn->refKey : conn->key.data + conn->keyStart;
+
+	if(length == 0)
+		return 1;
+
+	char* room = reserveOutput(conn, OTP_HEADER_SIZE + length);
+	if(room == NULL)
+		return 0;
+
+	struct otpFrameHeader header = { OTP_FRAME_RESULT_CHUNK, 0, conn->request, length };
+	otpPackHeader(room, &header);
+	transform(conn, room + OTP_HEADER_SIZE, conn->text.data + conn->textStart, key, length);
+
+	conn->textStart += length;
+	if(conn->refKey != NULL)
+	{
+		conn->refKey += length;
+		conn->refKeyLeft -= length;
+	}
+	else
+		conn->keyStart += length;
+	return 1;
+}
+
+// Queues a frame with the given payload (which may be NULL when length is 0),
+// tagged with the current request. A queued ERROR also ends the connection. Returns 0 if memory ran out
+static int queueFrame(struct otpConnection* conn, int type, const char* payload, size_t length)
+{
+	return queueFlaggedFrame(conn, type, 0, payload, length);
+}
+
+// The same with flags set in the header
+static int queueFlaggedFrame(struct otpConnection* conn, int type, int flags, const char* payload, size_t length)
+{
+	struct otpFrameHeader header = { type, flags, conn->request, length };
+	char* room = reserveOutput(conn, OTP_HEADER_SIZE + length);
+	if(room == NULL)
+		return 0;
+
+	otpPackHeader(room, &header);
+	if(length > 0)
+		memcpy(room + OTP_HEADER_SIZE, payload, length);
+
+	// after an ERROR, swallow whatever the client is still sending so it
+	// can finish and read the error instead of being reset
+	if(type == OTP_FRAME_ERROR)
+		conn->state = CONN_DRAIN;
+	return 1;
+}
+
+// How far a legacy package buffer may grow: the package limit plus one
+// block of room to receive into past the '?'
+static size_t legacyLimit(struct otpConnection* conn)
+{
+	size_t limit = conn->config->packageLimit;
+	return (limit > OTP_BUFFER_UNLIMITED - OTP_LEGACY_BLOCK) ? OTP_BUFFER_UNLIMITED : limit + OTP_LEGACY_BLOCK;
+}
+
+// Points *window at the staging buffer, allocated on first use, whose
+// contents otpConnFeed always takes apart in full; returns its size, or
+// 0 if memory ran out
+static size_t stagingWindow(struct otpConnection* conn, char** window)
+{
+	if(!otpBufferReserve(&conn->staging, OTP_STAGING_SIZE, OTP_STAGING_SIZE))
+		return 0;
+	*window = conn->staging.data;
+	return conn->staging.capacity;
+}
+
+// Transforms the received text with the key (or the pad it named) straight into the output
+// buffer, as a RESULT frame or terminated with '?' for legacy clients
+// Returns 0 if memory ran out
+static int finishRequest(struct otpConnection* conn)
+{
+	size_t length = conn->text.length;
+	int framed = conn->accepted;
+	char* result = reserveOutput(conn, framed ? OTP_HEADER_SIZE + length : length + 1);
+	if(result == NULL)
+		return 0;
+
+	if(framed)
+	{
+		struct otpFrameHeader header = { OTP_FRAME_RESULT, 0, conn->request, length };
+		otpPackHeader(result, &header);
+		result += OTP_HEADER_SIZE;
+	}
+	else
+		result[length] = '?';
+
+	transform(conn, result, conn->text.data, (conn->refKey != NULL) ? conn->refKey : conn->key.data, length);
+	return 1;
+}
+
+// Grows the output buffer and returns room for n more bytes at its end
+// (NULL if memory ran out)
+static char* reserveOutput(struct otpConnection* conn, size_t n)
+{
+	// once most of the buffer has gone out, slide the rest to the front
+	// so a long stream keeps reusing the same memory
+	if(conn->outSent > 0 && conn->outSent >= conn->out.length / 2)
+	{
+		memmove(conn->out.data, conn->out.data + conn->outSent, conn->out.length - conn->outSent);
+		conn->out.length -= conn->outSent;
+		conn->outSent = 0;
+	}
+
+	if(n > OTP_BUFFER_UNLIMITED - conn->out.length || !otpBufferReserve(&conn->out, conn->out.length + n, OTP_BUFFER_UNLIMITED))
+		return NULL;
+
+	char* room = conn->out.data + conn->out.length;
+	conn->out.length += n;
+	return room;
+}
+
+// Brings the event loop's in-flight total up to date with what this
+// connection holds now: packages received and output not yet sent
+static void charge(struct otpConnection* conn)
+{
+	if(conn->load == NULL)
+		return;
+	size_t holding = conn->text.length + conn->key.length + conn->out.length - conn->outSent;
+	conn->load->inFlight = conn->load->inFlight - conn->charged + holding;
+	conn->charged = holding;
+}
+
+// Runs the service's transform, or XOR on a binary connection, timing
+// it when metrics are kept
+static void transform(struct otpConnection* conn, char* out, const char* text, const char* key, size_t length)
+{
+	void (*run)(char*, const char*, const char*, size_t) = conn->binary ? otpXor : conn->service->transform;
+	if(conn->metrics == NULL)
+	{
+		run(out, text, key, length);
+		return;
+	}
+
+	uint64_t start = otpMetricsNow();
+	run(out, text, key, length);
+	conn->transformNs += otpMetricsNow() - start;
+}
+
+// Records how long the handshake took; for a legacy client the request
+// starts right after it
+static void measureHandshake(struct otpConnection* conn, int accepted)
+{
+	if(conn->metrics == NULL)
+		return;
+
+	uint64_t now = otpMetricsNow();
+	otpHistogramRecord(&conn->metrics->phases[OTP_PHASE_HANDSHAKE], now - conn->phaseStart);
+	if(!accepted)
+		otpMetricAdd(&conn->metrics->rejected, 1);
+	conn->phaseStart = now;
+}
+
+// Records a request whose answer is now queued, and starts timing its send
+static void measureRequest(struct otpConnection* conn)
+{
+	if(conn->metrics == NULL)
+		return;
+
+	uint64_t now = otpMetricsNow();
+	otpHistogramRecord(&conn->metrics->phases[OTP_PHASE_RECEIVE], now - conn->phaseStart);
+	otpHistogramRecord(&conn->metrics->phases[OTP_PHASE_TRANSFORM], conn->transformNs);
+	otpMetricAdd(&conn->metrics->requests, 1);
+	conn->transformNs = 0;
+	conn->sendStart = now;
+}
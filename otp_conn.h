@@ -0,0 +1,158 @@
+#ifndef OTP_CONN_H
+#define OTP_CONN_H
+
+#include <stddef.h>
+#include <signal.h>
+#include "otp_server.h"
+#include "otp_proto.h"
+#include "otp_buffer.h"
+#include "otp_metrics.h"
+#include "otp_timer.h"
+
+// Per-connection protocol state machine (libotp).
+// It never touches the socket: an I/O backend asks where received bytes
+// should go, hands them over, and sends whatever output is pending. That
+// keeps the protocol independent of how the backend waits for readiness.
+
+// states a connection moves through
+enum otpConnState
+{
+	CONN_HANDSHAKE,			// waiting for the 4 character client id or the framed preamble
+	CONN_RECV_TEXT,			// legacy: reading the text package up to its '?'
+	CONN_SKIP_PAD,			// legacy: skipping the padding after the text package
+	CONN_RECV_KEY,			// legacy: reading the key package up to its '?'
+	CONN_FRAME_HEADER,		// framed: reading a 16 byte frame header, between requests too
+	CONN_FRAME_PAYLOAD,		// framed: reading a payload straight into its destination
+	CONN_DRAIN,				// request refused, discard input until the client hangs up
+	CONN_CLOSING			// nothing more to read, close once output is flushed
+};
+
+// what an event loop's admitted connections hold between them, checked
+// against the admission limits whenever a client arrives
+struct otpLoad
+{
+	int connections;		// admitted and still open
+	size_t inFlight;		// request bytes received and answer bytes not yet sent
+};
+
+struct otpConnection
+{
+	int fd;
+	enum otpConnState state;
+	const struct otpService* service;
+	const struct otpServerConfig* config;
+
+	// client id (or framed preamble) read during the handshake
+	char id[4];
+	size_t idLength;
+
+	// framed protocol: header being read, and where its payload goes
+	char header[OTP_HEADER_SIZE];
+	size_t headerLength;
+	struct otpFrameHeader frame;
+	char* payload;
+	size_t payloadGot;
+	int accepted;			// HELLO passed
+	int binary;				// HELLO asked for OTP_HELLO_BINARY: raw bytes, XOR transform
+	int haveText;			// TEXT frame received, KEY may follow
+	int streaming;			// request is arriving as TEXT_CHUNK / KEY_CHUNK frames
+	uint32_t request;		// id of the request being served, echoed in every answer
+
+	// KEY_REF: offset and pad name, then the pad symbols this request may still use
+	char reference[OTP_KEY_REF_OFFSET_SIZE + OTP_PAD_NAME_MAX];
+	const char* refKey;		// NULL unless the request named a pad
+	size_t refKeyLeft;
+
+	// received packages, grown as data arrives; while streaming they hold a
+	// fixed window and [textStart, text.length) is not yet transformed
+	struct otpBuffer text;
+	struct otpBuffer key;
+	size_t textStart;
+	size_t keyStart;
+
+	// bytes of legacy padding left to skip
+	size_t padLeft;
+
+	// framed: where headers and small payloads are received, many frames
+	// per recv, before otpConnFeed copies each to where it belongs
+	struct otpBuffer staging;
+
+	// queued output and how much of it has been sent
+	struct otpBuffer out;
+	size_t outSent;
+
+	// the worker's metrics (NULL for none) and when the phase being timed
+	// began; transform time is summed over the request
+	struct otpMetrics* metrics;
+	uint64_t phaseStart;
+	uint64_t transformNs;
+	uint64_t sendStart;		// 0 unless an answer is waiting to go out
+
+	// admission: the event loop's load (NULL outside a backend), whether
+	// this client came in over a limit, and the bytes it counts for
+	struct otpLoad* load;
+	int busy;
+	size_t charged;
+
+	// owned by the backend: registered event mask (or operations in
+	// flight), where the last recv went, its deadline, and list links
+	unsigned int events;
+	char* window;
+	struct otpTimer deadline;
+	struct otpConnection* prev;
+	struct otpConnection* next;
+};
+
+// prepares conn (fresh or reused, keeping its buffers) for a new client on fd,
+// recording into metrics unless it is NULL
+void otpConnReset(struct otpConnection* conn, const struct otpService* service, const struct otpServerConfig* config,
+	struct otpMetrics* metrics, int fd);
+
+// counts a freshly reset conn toward load, or, if the event loop is at
+// one of the config's admission limits, marks it to be turned away as busy
+void otpConnAdmit(struct otpConnection* conn, struct otpLoad* load);
+
+// takes a connection that is being closed off its event loop's load
+void otpConnRelease(struct otpConnection* conn);
+
+// releases the buffers of a connection that will not be reused
+void otpConnFree(struct otpConnection* conn);
+
+// points *window at where the next received bytes belong, returns its size
+// 0 while the connection is readable means it hit a size limit and should be dropped
+size_t otpConnWindow(struct otpConnection* conn, char** window);
+
+// processes length received bytes starting at data, which may already be the window
+// returns 0 if the client broke the protocol and should be dropped
+int otpConnFeed(struct otpConnection* conn, const char* data, size_t length);
+
+// 1 while the connection wants input; reading pauses while a lot of
+// output is waiting, so a slow reader cannot make it buffer without bound
+int otpConnReadable(struct otpConnection* conn);
+
+// output waiting to be sent, returns its length
+size_t otpConnPending(struct otpConnection* conn, const char** data);
+
+// records that length bytes of pending output went out
+void otpConnSent(struct otpConnection* conn, size_t length);
+
+// 1 once everything is done and the socket can be closed
+int otpConnFinished(struct otpConnection* conn);
+
+// milliseconds the connection may go without progress from here, by the
+// deadline that applies now (write while output is waiting, idle between
+// requests, read otherwise); 0 if there is none
+unsigned int otpConnTimeout(struct otpConnection* conn);
+
+// I/O backends: serve connections on listenSocketFD until *keepRunning drops to 0
+
+// epoll event loop (otp_reactor.c)
+void otpRunReactor(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	int listenSocketFD, volatile sig_atomic_t* keepRunning);
+
+// io_uring completion loop (otp_uring.c); returns -1 without serving
+// anything if the kernel lacks io_uring or an operation it needs
+int otpRunUring(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	int listenSocketFD, volatile sig_atomic_t* keepRunning);
+
+#endif
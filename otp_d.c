@@ -0,0 +1,36 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "otp_codec.h"
+#include "otp_server.h"
+
+// otp_d serves both clients on one port: otp_enc (id 5512) is encoded,
+// otp_dec (id 2155) decoded, by the same workers
+
+static const struct otpService decryptService =
+{
+	"otp_d",
+	2155,
+	otpDecode,
+	NULL
+};
+
+static const struct otpService encryptService =
+{
+	"otp_d",
+	5512,
+	otpEncode,
+	&decryptService
+};
+
+int main(int argc, char *argv[])
+{
+	// select the fastest codec kernel this CPU supports
+	otpCodecInit();
+
+	// port and worker count from the command line
+	struct otpServerConfig config;
+	otpServerParseArgs(argc, argv, &config);
+
+	// listen until SIGINT
+	return otpServe(&encryptService, &config);
+}
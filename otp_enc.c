@@ -2,12 +2,16 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/types.h>
-#include <sys/socket.h>
-#include <netinet/in.h>
-#include <netdb.h> 
-#include <sys/stat.h> 
 #include <fcntl.h>
+#include <getopt.h>
+#include <sys/types.h>
+#include "otp_codec.h"
+#include "otp_client.h"
+#include "otp_batch.h"
+#include "otp_local.h"
+
+// usage, for the single file, offline and batch forms
+static const char usage[] = "USAGE: %s [-x] [-o output] textfilename keyfilename|pad:name[:offset] port|unix:path\n       %s --offline [-x] [-o output] textfilename keyfilename\n       %s [--offline] [-x] -f manifest|directory [-j connections] [port|unix:path]\n";
 
 // unique id used to validate identity when connecting
 const int u_id = 5512;
@@ -29,309 +33,182 @@ void error(const char *msg, int perrorOutput)
 	}
 } 
 
-// forward declarations
-int performHandshake(int *server);
-int checkText(FILE* checkMe);
-void packageData(char** package, FILE* src);
-void sendPackage(int *server, char* toSend);
-void receiveCipher(char** cipher, int *socketFD);
+// reports the first invalid byte of a text or key and exits
+void invalidCharacter(const char* what, long long offset)
+{
+	fprintf(stderr,"Invalid character detected in %s at byte %lld.\n", what, offset);
+	exit(1);
+}
 
 // main
 int main(int argc, char *argv[])
 {
 
-	// socket descriptor and portNumber
-    int socketFD, portNumber;
-	// below structs used to build and connect to server
-    struct sockaddr_in serverAddress;
-	struct hostent* serverHostInfo;
-
-	// confirm correct number of arguments was received. If not, print out usage.   
-    if (argc < 4) { fprintf(stderr,"USAGE: %s textfilename keyfilename port\n", argv[0]); exit(0); } // Check usage & args
+	// socket descriptor
+    int socketFD;
+
+	// the widest validation kernel this CPU has
+	otpCodecInit();
+
+	// batch mode: -f names a manifest of triples or a directory, -j the connections to spread it over;
+	// --offline transforms here instead of in the daemon; -o writes the result to a file rather than stdout;
+	// -x (--binary) takes any bytes, XORed with a raw key from keygen -x, and adds no newline
+	static const struct option longOptions[] = { { "offline", no_argument, NULL, 'O' }, { "binary", no_argument, NULL, 'x' }, { NULL, 0, NULL, 0 } };
+	const char* batchSource = NULL;
+	int connections = 1;
+	int offline = 0;
+	int binary = 0;
+	const char* outputPath = NULL;
+	int opt;
+	while((opt = getopt_long(argc, argv, "f:j:o:x", longOptions, NULL)) != -1)
+	{
+		switch(opt)
+		{
+			case 'O':
+				offline = 1;
+				break;
+			case 'f':
+				batchSource = optarg;
+				break;
+			case 'j':
+				connections = atoi(optarg);
+				break;
+			case 'o':
+				outputPath = optarg;
+				break;
+			case 'x':
+				binary = 1;
+				break;
+			default:
+				fprintf(stderr, usage, argv[0], argv[0], argv[0]);
+				exit(1);
+		}
+	}
 
-    /*open text file and check it*/
-	//hold path for file, and set to empty
-    char textPath[64];
-	memset(textPath, '\0', sizeof(char));
+	// confirm correct number of arguments was received. If not, print out usage.
+    if (argc - optind < (batchSource != NULL ? 1 : 3) - offline || connections < 1) { fprintf(stderr, usage, argv[0], argv[0], argv[0]); exit(0); } // Check usage & args
 
-	// add leading ./ to look in current dir
-    strcat(textPath,"./");
+	if(batchSource != NULL)
+	{
+		struct otpBatch batch;
+		if(otpBatchLoad(&batch, batchSource) < 0)
+			exit(1);
+		batch.binary = binary;
+		if(offline)
+		{
+			struct otpContext context;
+			otpContextInit(&context, binary ? OTP_XOR : OTP_ENCRYPT);
+			int failed = otpBatchRunLocal(&batch, &context, connections);
+			otpContextFree(&context);
+			otpBatchFree(&batch);
+			return failed ? 1 : 0;
+		}
+		int failed = otpBatchRun(&batch, argv[optind], u_id, connections, "Error. otp_dec_d will not accept connections from otp_enc.");
+		otpBatchFree(&batch);
+		return failed ? 1 : 0;
+	}
+	argv += optind - 1; // the single file arguments, as argv[1] to argv[3]
 
-	//add file name to path
-    strcat(textPath, argv[1]);
+	// where the result goes; read and write, so offline it can be written through a mapping
+	int outputFD = STDOUT_FILENO;
+	if(outputPath != NULL && (outputFD = open(outputPath, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0)
+		error("Error opening output file.",1);
 
-	// open the file
-    FILE* textFP = fopen(textPath,"r");
+	if(offline)
+	{
+		// no daemon: the files are mapped and transformed here, straight to the output
+		if(strncmp(argv[2], "pad:", 4) == 0)
+			error("Pads are held by the daemon, use the pad file as the key with --offline.",0);
+		int textFD = open(argv[1], O_RDONLY);
+		if(textFD < 0) // error opening
+			error("Error opening text file.",1);
+		int keyFD = open(argv[2], O_RDONLY);
+		if(keyFD < 0) // error opening
+			error("Error opening key file.",1);
+
+		struct otpContext context;
+		otpContextInit(&context, binary ? OTP_XOR : OTP_ENCRYPT);
+		int status = otpContextRunFD(&context, outputFD, textFD, keyFD);
+		if(status == -1)
+			error("Error transforming file.",1);
+		else if(status == OTP_LOCAL_INVALID_TEXT)
+			invalidCharacter("text message", context.invalid);
+		else if(status == OTP_LOCAL_INVALID_KEY)
+			invalidCharacter("key", context.invalid);
+		else if(status == OTP_LOCAL_SHORT_KEY)
+			error("Key length is too short.",0);
+		otpContextFree(&context);
+		close(textFD);
+		close(keyFD);
+		if(close(outputFD) < 0)
+			error("Error writing output file.",1);
+		return 0;
+	}
 
-	if(textFP == NULL) // error opening
+    /*map the text and key files and check them*/
+	// the name is used as given, so relative names still resolve from the
+	// current directory and absolute or long paths work too; both files
+	// are validated and later sent straight from the mapping
+	struct otpInput text, key;
+
+	// the key is either a file or pad:<name>[:<offset>], a pad the daemon holds
+	struct otpRequest request;
+	memset(&request, 0, sizeof(request));
+	int usePad = otpParsePadReference(argv[2], &request);
+	if(usePad && binary)
+		error("Pads hold symbols, binary mode needs a key file.",0);
+
+	// one pass over each finds its end and checks it, the two side by side
+	int keyStatus;
+	int textStatus = otpMapInputs(argv[1], &text, usePad ? NULL : argv[2], &key, &keyStatus, binary);
+	if(textStatus == -1) // error opening
 		error("Error opening text file.",1);
-
-	/*open key file and check it*/
-	// hold path and set to empty
-	char keyPath[64];
-    memset(keyPath, '\0', sizeof(char));
-	// build up path/file name
-    strcat(keyPath,"./");
-	strcat(keyPath, argv[2]);
-   
-	// open the key file
-    FILE* keyFP = fopen(keyPath,"r");
-	if(keyFP == NULL) // error opening
+	if(keyStatus == -1) // error opening
 		error("Error opening key file.",1);
 
-	// stores the length of the two files if they are properly validated
-	// if an invalid character is found, it is set to -3 
-    int lengthPlaintext = checkText(textFP);
-    int lengthKey = checkText(keyFP);
-	
-	// use lengthPlaintext to allocate room for the ciphertext we will receive back
-	char* cipherText = calloc(sizeof(char) * lengthPlaintext,sizeof(char));
-
-	// pointers to hold the 'packaged' contents of the key and text files
-	char *textPackage = NULL;
-	char *keyPackage = NULL;
+	// stores the length of the text if it is properly validated
+	off_t lengthPlaintext = text.length;
 
-	// check if either file has invalid character (set to -3 in checkText)
-	if (lengthPlaintext == -3)
-		error("Invalid character detected in text message.", 0);
-	else if (lengthKey == -3)
-		error("Invalid character detected in key.", 0);
-	else if (lengthPlaintext > lengthKey) // check if the key is at least as long as text file
+	// check if either file has an invalid character (-3 from otpMapInputs)
+	if (textStatus == -3)
+		invalidCharacter("text message", text.invalid);
+	else if (keyStatus == -3)
+		invalidCharacter("key", key.invalid);
+	else if (!usePad && lengthPlaintext > key.length) // check if the key is at least as long as text file (the daemon checks pads)
     {
 		error("Key length is too short.",0);
     }
-	else // files passed validation
-	{
-		// after this call, textPackage will contain the entire text and key file will contain the entire key
-		// packages are terminated by a '?'
-		packageData(&textPackage, textFP);
-		packageData(&keyPackage, keyFP);
-
-		// done with files, closing
-		fclose(keyFP);
-		fclose(textFP);
-    }
-   
-	// Set up the server address struct
-	memset((char*)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
-	portNumber = atoi(argv[3]); // Get the port number, convert to an integer from a string
-	serverAddress.sin_family = AF_INET; // Create a network-capable socket
-	serverAddress.sin_port = htons(portNumber); // Store the port number
-	serverHostInfo = gethostbyname("eos-class.engr.oregonstate.edu"); // Convert the machine name into a special form of address
-	if (serverHostInfo == NULL) { fprintf(stderr, "CLIENT: ERROR, no such host\n"); exit(0); }
-	memcpy((char*)&serverAddress.sin_addr.s_addr, (char*)serverHostInfo->h_addr, serverHostInfo->h_length); // Copy in the address
-
-	// Set up the socket
-	socketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
-	if (socketFD < 0) error("CLIENT: ERROR opening socket\n", 1);
-	
-	// Connect to server
-	if (connect(socketFD, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to address
-		error("CLIENT: ERROR connecting",1);
 
-	// perform handshake (confirm program is able to connect to the indicated server)
-	int connectionAccepted = performHandshake(&socketFD);
+	// connect to otp_enc_d on the given port or UNIX socket and perform the handshake
+	// (confirm program is able to connect to the indicated server), waiting out a busy daemon
+	socketFD = otpOpen(argv[3], u_id, binary ? OTP_HELLO_BINARY : 0);
 
 	// if connection accepted is true (connected to otp_enc_d)
-	if(connectionAccepted)
+	if(socketFD >= 0)
 	{
-		// send the text package
-		sendPackage(&socketFD, textPackage);	
-		// free the textPackage memory
-		free(textPackage);
-		
-		// send the key package
-		sendPackage(&socketFD, keyPackage);	
-		// free key package memory
-		free(keyPackage);
+		// stream the text (and key) in chunks while the result comes back and is written out
+		request.text = text.data;
+		request.key = key.data;
+		request.length = lengthPlaintext;
+		request.outFD = outputFD;
+		if(outputPath != NULL)
+			otpReserveOutput(outputFD, lengthPlaintext + !binary);
+		char message[OTP_ERROR_MAX];
+		if(otpPipeline(socketFD, &request, 1, message, sizeof(message)) < 1)
+			error(message,0);
 	}
 	else // server returned a false for handshake, meaning it will not accept connections from otp_enc
 	{
 		error("Error. otp_dec_d will not accept connections from otp_enc.",0);
 	}
 
-	// Get ciphertext from server and print it out
-	receiveCipher(&cipherText,&socketFD);	
-	
-	printf("%s\n",cipherText);
+	// the ciphertext went out as it arrived, finish its line (binary output has none)
+	if((!binary && write(outputFD, "\n", 1) != 1) || (outputFD != STDOUT_FILENO && close(outputFD) < 0))
+		error("Error writing output.",1);
+	otpUnmapInput(&text);
+	otpUnmapInput(&key);
 
-	
 	//close socket
 	close(socketFD); // Close the socket
 	return 0;
 }
-
-// Prepares for and receives the encoded text from otp_enc_d
-// Accepts: char** for where to store the cipher and a int* for the socket to receive on
-void receiveCipher(char** cipher, int *socketFD)
-{
-	// check read amount
-	int charsRead = 1;
-
-	//boolean for checking if terminating character is reached
-	int terminatorFound = 0;
-
-	//iterate through cipher to place at right point
-	int cipherIter = 0;
-
-	// hold read infor before stuffing into cipher
-	char* tmpBuffer = calloc(sizeof(char)*70000,sizeof(char));
-
-	//clear strings
-	memset(tmpBuffer, '\0', sizeof(tmpBuffer));
-	memset(*cipher, '\0', sizeof(*cipher)); // Clear out the buffer again for reuse
-	
-	// while we are still receiving data and the terminator has not been reached
-	while(charsRead > 0 && !terminatorFound)
-	{
-		// receive up to 70000 characters worth of data
-		charsRead = recv(*socketFD, tmpBuffer, sizeof(tmpBuffer), 0); // Read data from the socket, leaving \0 at end
-		
-		// copy character by character into cipher from tmpBuffer
-		int i;
-		for(i = 0; i < strlen(tmpBuffer); i++)
-		{
-			// check if terminator is found
-			if(tmpBuffer[i] == '?')
-			{
-				// flip flag and break out
-				terminatorFound = 1;
-				break;
-			}
-			// otherwise insert character into cipher and increment the iterator
-			(*cipher)[cipherIter] = tmpBuffer[i];
-			cipherIter++;
-		}
-
-		//reset to empty
-		memset(tmpBuffer, '\0', sizeof(tmpBuffer));
-	}
-}	
-
-
-// Checks to ensure text in passed in file is valid and counts the length of the text
-// Accepts a FILE* to the file we are checking
-// return value is either the length of the text, or -3 if an invalid character was found
-int checkText(FILE* checkMe)
-{
-	// hold the last character read
-	char tmp;
-	int charsRead = 0;
-	
-	// read a single character
-	tmp = fgetc(checkMe);
-
-	//increment count
-	charsRead++;
-
-	// while newline and EOF are not reached
-	while(tmp != '\n' && tmp != EOF)
-	{
-		
-		// if character's ascii value is less than 65 (A) or greater than 90 (Z)
-		if(tmp < 65 || tmp > 90)
-		{
-			// if out of the range, check if it is 32 (space)
-			if(tmp != 32)
-			{
-				//if it is not a space, return -3 to indicate an invalid
-				//character has been found
-				return -3;
-			}
-		}
-		// good character found, so read next character and increment
-		tmp = fgetc(checkMe);
-		charsRead++;
-	}
-
-	// return count of characters
-	return charsRead;
-}
-
-// Reads text from a file into a character string (package)
-// Accepts char** package to store text in, FILE* src for source file
-void packageData(char** package, FILE* src)
-{
-	// rewind file to start
-	rewind(src);
-	// hold character read
-	char* temp;
-
-	// get length of each file to properly allocate memory
-	// go to end of text file
-	if(fseek(src,0, SEEK_END) == 0)
-	{
-		long Bufsize = ftell(src); //get size of text file
-		if(Bufsize == -1)
-			error("Error occurred in finding file length.",1);
-
-		// allocate package to the size of the file
-		*package = calloc((sizeof(char) * Bufsize) + 1 ,sizeof(char));// '+1' is to accomodate the ? character used to terminate the msg
-
-		//rewind file to beginning
-		rewind(src);
-		size_t readSize = fread(*package,sizeof(char),(Bufsize - 1),src); // read text into package first
-		strcat(*package,"?");// '?' is used to identify the end of the text and start of the key
-	}
-}
-
-// Performs handshake with server to confirm it is connecting with otp_enc_d
-// Accepts int* for the server we are connecting to
-// Returns 1 or 0 indicating if connection is accepted or refused
-// Accepted: connecting to otp_enc_d. Refused: connecting to otp_dec_d.
-int performHandshake(int *server)
-{
-	// hold unique id string
-	char temp[4];
-	
-	// holds value for return
-	int responseCode = 0;
-
-	// copy u_id into temp string
-	sprintf(temp,"%d",u_id);
-	// send string to server
-	int dataSent = send(*server,temp,strlen(temp),0);
-	if(dataSent < 0)
-		error("Error sending handshake.",1);
-	if(dataSent < strlen(temp))
-		error("Not all data was written",0);
-
-	// to receive response
-	char handshakeResponse[2];
-	memset(handshakeResponse,'\0',5);
-
-	// read response
-	int read = recv(*server,handshakeResponse,sizeof(handshakeResponse)-1,0);
-
-	if(read != 1)
-		error("Error reading from server.",1);
-
-	// convert string response into integer and return value
-	responseCode = atoi(handshakeResponse);
-	return(responseCode);		
-}	
-
-
-// Sends the provided text package to the indicated server
-// Accepts int* server for where to send file and char* toSend, the package to be sent
-void sendPackage(int *server, char* toSend)
-{
-	// store the number of bytes to send
-	long int bytesToSend = strlen(toSend);
-	
-	// set to zero to ensure accurate counts
-	long int bytesSent = 0;
-	long int totalSent = 0;
-	
-	// loop to send until all data sent
-	while(totalSent < bytesToSend)
-	{
-		// send data and store in bytesSent
-		bytesSent = send(*server, toSend + totalSent, 1024,0);
-		
-		// add to totalSent
-		totalSent += bytesSent;
-	}
-
-}	
-
@@ -0,0 +1,51 @@
+#include "otp_histogram.h"
+
+uint64_t otpHistogramBucketMax(int index)
+{
+	if(index < 2 * OTP_HIST_HALF)
+		return (uint64_t)index;
+
+	// undo otpHistogramIndex: which power of two, and which step within it
+	int shift = index / OTP_HIST_HALF - 1;
+	uint64_t top = (uint64_t)(index % OTP_HIST_HALF + OTP_HIST_HALF);
+	if(shift >= 64 - OTP_HIST_SUB_BITS + 1)
+		return UINT64_MAX;
+	return ((top + 1) << shift) - 1;
+}
+
+uint64_t otpHistogramPercentile(const struct otpHistogram* histogram, double fraction)
+{
+	if(histogram->count == 0)
+		return 0;
+
+	// rank of the value wanted, counting from 1
+	uint64_t rank = (uint64_t)(fraction * histogram->count + 0.5);
+	if(rank < 1)
+		rank = 1;
+	if(rank > histogram->count)
+		rank = histogram->count;
+
+	uint64_t seen = 0;
+	int i;
+	for(i = 0; i < OTP_HIST_BUCKETS; i++)
+	{
+		seen += histogram->buckets[i];
+		if(seen >= rank)
+		{
+			uint64_t top = otpHistogramBucketMax(i);
+			return (top < histogram->max) ? top : histogram->max;
+		}
+	}
+	return histogram->max;
+}
+
+void otpHistogramMerge(struct otpHistogram* into, const struct otpHistogram* from)
+{
+	int i;
+	for(i = 0; i < OTP_HIST_BUCKETS; i++)
+		into->buckets[i] += from->buckets[i];
+	into->count += from->count;
+	into->sum += from->sum;
+	if(from->max > into->max)
+		into->max = from->max;
+}
@@ -0,0 +1,55 @@
+#ifndef OTP_HISTOGRAM_H
+#define OTP_HISTOGRAM_H
+
+#include <stdint.h>
+
+// Log-linear histogram (libotp), in the style of HdrHistogram: values
+// below 2^OTP_HIST_SUB_BITS are counted exactly, larger ones in buckets
+// of 2^OTP_HIST_SUB_BITS / 2 per power of two, so every bucket is within
+// about 1.6% of its values. Recording is a few integer operations and
+// one increment, with no allocation and no locking (one writer).
+
+#define OTP_HIST_SUB_BITS 7
+#define OTP_HIST_HALF (1 << (OTP_HIST_SUB_BITS - 1))
+#define OTP_HIST_BUCKETS ((64 - OTP_HIST_SUB_BITS + 2) * OTP_HIST_HALF)
+
+struct otpHistogram
+{
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[OTP_HIST_BUCKETS];
+};
+
+// bucket a value falls in
+static inline int otpHistogramIndex(uint64_t value)
+{
+	if(value < 2 * OTP_HIST_HALF)
+		return (int)value;
+
+	// top OTP_HIST_SUB_BITS bits of the value pick the bucket
+	int magnitude = 63 - __builtin_clzll(value);
+	int shift = magnitude - (OTP_HIST_SUB_BITS - 1);
+	return (shift + 1) * OTP_HIST_HALF + (int)(value >> shift) - OTP_HIST_HALF;
+}
+
+static inline void otpHistogramRecord(struct otpHistogram* histogram, uint64_t value)
+{
+	histogram->buckets[otpHistogramIndex(value)]++;
+	histogram->count++;
+	histogram->sum += value;
+	if(value > histogram->max)
+		histogram->max = value;
+}
+
+// largest value that lands in bucket index
+uint64_t otpHistogramBucketMax(int index);
+
+// value at or below which the given fraction (0-1) of recorded values fall,
+// reported as the top of its bucket; 0 for an empty histogram
+uint64_t otpHistogramPercentile(const struct otpHistogram* histogram, double fraction);
+
+// adds every count in from into into
+void otpHistogramMerge(struct otpHistogram* into, const struct otpHistogram* from);
+
+#endif
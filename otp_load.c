@@ -0,0 +1,622 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include "otp_codec.h"
+#include "otp_proto.h"
+#include "otp_client.h"
+#include "otp_histogram.h"
+
+// Load generator for otp_enc_d / otp_dec_d. Keeps -c connections busy
+// with requests whose sizes are drawn from the -s mix, either closed loop
+// (each connection sends its next request as soon as the last answer is
+// in) or at a fixed total rate (-r requests per second). At a fixed rate,
+// latency is measured from when a request was due to be sent rather than
+// when a free connection got to send it, so a stalled daemon is charged
+// for the requests it held up (coordinated omission correction).
+
+#define LOAD_MAX_SIZES 32
+#define LOAD_MAX_EVENTS 64
+#define LOAD_RECV_SIZE (256 * 1024)
+
+// after the run, requests still in flight get this long to finish
+#define LOAD_DRAIN_NS 10000000000ULL
+
+// epoll data of the timer that paces fixed rate requests
+#define LOAD_TIMER UINT32_MAX
+
+// handshake ids of otp_enc_d and otp_dec_d
+#define LOAD_ENC_ID 5512
+#define LOAD_DEC_ID 2155
+
+// one entry of the size mix and the request that goes with it, built once
+// and shared by every connection
+struct loadSize
+{
+	size_t bytes;
+	unsigned weight;
+	char* wire;
+	size_t wireLength;
+};
+
+// one client connection with at most one request in flight
+struct loadConn
+{
+	int fd;					// -1 between legacy requests
+	int busy;
+	const struct loadSize* size;
+	size_t sent;			// bytes of size->wire sent so far
+	int writing;			// waiting for EPOLLOUT
+	uint64_t intended;		// when the request was due
+	uint64_t started;		// when it was actually sent
+	// answer parsing
+	char header[OTP_HEADER_SIZE];
+	size_t headerGot;
+	uint64_t payloadLeft;
+	int error;				// the answer is an ERROR frame
+	int handshakeSeen;		// legacy: the '1' before the result has arrived
+};
+
+// forward declarations
+static int parseSizes(char* argument);
+static void buildWire(struct loadSize* size, int legacy, int handshakeId);
+static void openConnection(struct loadConn* conn, int index);
+static void closeConnection(struct loadConn* conn);
+static void startRequest(struct loadConn* conn, int index, uint64_t intended, uint64_t now);
+static int sendRequest(struct loadConn* conn, int index);
+static int receiveAnswer(struct loadConn* conn);
+static int parseFramed(struct loadConn* conn, const char* data, size_t length);
+static int parseLegacy(struct loadConn* conn, const char* data, size_t length);
+static void finishRequest(struct loadConn* conn, int index, uint64_t now);
+static void failRequest(struct loadConn* conn, int index);
+static void watch(struct loadConn* conn, int index, int op, int writing);
+static const struct loadSize* pickSize();
+static void printLatency(const char* label, const struct otpHistogram* histogram);
+static uint64_t nowNs();
+
+static struct loadSize loadSizes[LOAD_MAX_SIZES];
+static int loadSizeCount = 0;
+static unsigned loadWeightTotal = 0;
+
+static char loadAddress[512];	// <host>:<port> or unix:<path>
+static int loadLegacy = 0;
+static int loadHandshakeId = LOAD_ENC_ID;
+static int loadEpollFD;
+static int loadTimerFD = -1;
+
+// idle connections, ready for the next request
+static int* loadIdle;
+static int loadIdleCount = 0;
+static int loadInFlight = 0;
+
+// results: latency from when each request was due, and from when it was sent
+static struct otpHistogram loadLatency;
+static struct otpHistogram loadService;
+static uint64_t loadCompleted = 0, loadErrors = 0, loadBytes = 0;
+static uint64_t loadRandom = 0x9e3779b97f4a7c15ULL;
+
+static char loadScratch[LOAD_RECV_SIZE];
+
+int main(int argc, char* argv[])
+{
+	int connections = 1;
+	double seconds = 10, rate = 0;
+	char defaultSizes[] = "1024";
+	char* sizes = defaultSizes;
+	const char* host = "127.0.0.1";
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:t:r:s:h:dl")) != -1)
+	{
+		switch(opt)
+		{
+			case 'c': // concurrent connections
+				connections = atoi(optarg);
+				break;
+			case 't': // seconds to run
+				seconds = atof(optarg);
+				break;
+			case 'r': // total requests per second, 0 for closed loop
+				rate = atof(optarg);
+				break;
+			case 's': // size mix
+				sizes = optarg;
+				break;
+			case 'h': // host a bare port is on
+				host = optarg;
+				break;
+			case 'd': // talk to otp_dec_d
+				loadHandshakeId = LOAD_DEC_ID;
+				break;
+			case 'l': // legacy protocol, one connection per request
+				loadLegacy = 1;
+				break;
+			default:
+				connections = 0;
+				break;
+		}
+	}
+	if(optind != argc - 1 || connections < 1 || seconds <= 0 || rate < 0 || !parseSizes(sizes))
+	{
+		fprintf(stderr,"USAGE: %s [-c connections] [-t seconds] [-r rate] [-s size[:weight],...] [-d] [-l] [-h host] port|unix:path\n"
+			"       (a bare port is on host, default 127.0.0.1)\n", argv[0]);
+		exit(1);
+	}
+	if(strncmp(argv[optind], "unix:", 5) == 0)
+		snprintf(loadAddress, sizeof(loadAddress), "%s", argv[optind]);
+	else
+		snprintf(loadAddress, sizeof(loadAddress), "%s:%s", host, argv[optind]);
+
+	int i;
+	for(i = 0; i < loadSizeCount; i++)
+		buildWire(&loadSizes[i], loadLegacy, loadHandshakeId);
+	loadRandom ^= nowNs();
+
+	loadEpollFD = epoll_create1(0);
+	struct loadConn* conns = calloc(connections, sizeof(struct loadConn));
+	loadIdle = malloc(connections * sizeof(int));
+	if(loadEpollFD < 0 || conns == NULL || loadIdle == NULL)
+	{
+		fprintf(stderr,"Unable to set up %d connections.\n", connections);
+		exit(1);
+	}
+
+	// epoll_wait() only sleeps in whole milliseconds; a timer wakes the
+	// loop when the next fixed rate request is due
+	if(rate > 0)
+	{
+		struct epoll_event event;
+		event.events = EPOLLIN;
+		event.data.u64 = 0;
+		event.data.u32 = LOAD_TIMER;
+		loadTimerFD = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if(loadTimerFD < 0 || epoll_ctl(loadEpollFD, EPOLL_CTL_ADD, loadTimerFD, &event) < 0)
+		{
+			perror("timerfd");
+			exit(1);
+		}
+	}
+
+	// framed connections are opened (and handshaken) once, up front
+	for(i = 0; i < connections; i++)
+	{
+		conns[i].fd = -1;
+		if(!loadLegacy)
+			openConnection(&conns[i], i);
+		loadIdle[loadIdleCount++] = i;
+	}
+
+	uint64_t start = nowNs();
+	uint64_t end = start + (uint64_t)(seconds * 1e9);
+	uint64_t scheduled = 0, dispatched = 0;
+	uint64_t total = (uint64_t)(seconds * rate);
+	struct epoll_event events[LOAD_MAX_EVENTS];
+
+	while(1)
+	{
+		uint64_t now = nowNs();
+		int stopping = (now >= end);
+
+		// at a fixed rate, request k is due at start + k / rate whether or
+		// not a connection is free to send it then
+		if(rate > 0)
+		{
+			uint64_t due = (uint64_t)((now - start) * rate / 1e9) + 1;
+			scheduled = (due < total) ? due : total;
+		}
+
+		while(loadIdleCount > 0)
+		{
+			uint64_t intended;
+			if(rate > 0 && dispatched < scheduled)
+				intended = start + (uint64_t)(dispatched++ * 1e9 / rate);
+			else if(rate == 0 && !stopping)
+				intended = now;
+			else
+				break;
+
+			int index = loadIdle[--loadIdleCount];
+			startRequest(&conns[index], index, intended, now);
+		}
+
+		int backlog = (rate > 0) ? (dispatched < total) : !stopping;
+		if(loadInFlight == 0 && !backlog)
+			break;
+		if(stopping && now >= end + LOAD_DRAIN_NS)
+			break;
+
+		// sleep until the next request is due, the run ends, or an answer arrives
+		uint64_t wake = stopping ? end + LOAD_DRAIN_NS : end;
+		if(rate > 0 && scheduled < total)
+		{
+			uint64_t next = start + (uint64_t)(scheduled * 1e9 / rate);
+			struct itimerspec timer;
+			memset(&timer, 0, sizeof(timer));
+			timer.it_value.tv_sec = next / 1000000000ULL;
+			timer.it_value.tv_nsec = next % 1000000000ULL;
+			timerfd_settime(loadTimerFD, TFD_TIMER_ABSTIME, &timer, NULL);
+		}
+		int timeout = (wake > now) ? (int)((wake - now + 999999) / 1000000) : 0;
+
+		int n = epoll_wait(loadEpollFD, events, LOAD_MAX_EVENTS, timeout);
+		if(n < 0 && errno != EINTR)
+		{
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		for(i = 0; i < n; i++)
+		{
+			if(events[i].data.u32 == LOAD_TIMER)
+			{
+				// only a wake up, due requests go out at the top of the loop
+				uint64_t expirations;
+				if(read(loadTimerFD, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+					perror("timerfd");
+				continue;
+			}
+
+			int index = events[i].data.u32;
+			struct loadConn* conn = &conns[index];
+			if(!conn->busy)
+				continue;
+
+			if((events[i].events & (EPOLLOUT | EPOLLERR)) && conn->writing && !sendRequest(conn, index))
+			{
+				failRequest(conn, index);
+				continue;
+			}
+			if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+			{
+				int status = receiveAnswer(conn);
+				if(status < 0)
+					failRequest(conn, index);
+				else if(status > 0)
+					finishRequest(conn, index, nowNs());
+			}
+		}
+	}
+	uint64_t elapsed = nowNs() - start;
+
+	double wall = elapsed / 1e9;
+	printf("otp_load: %d connection%s, %s, %s protocol, %.2f s\n", connections, connections == 1 ? "" : "s",
+		rate > 0 ? "fixed rate" : "closed loop", loadLegacy ? "legacy" : "framed", wall);
+	printf("requests    %llu completed, %llu errors, %llu unanswered",
+		(unsigned long long)loadCompleted, (unsigned long long)loadErrors, (unsigned long long)loadInFlight);
+	if(rate > 0)
+		printf(", %llu never sent", (unsigned long long)(total - dispatched));
+	printf("\nthroughput  %.1f requests/s, %.2f MB/s of message\n", loadCompleted / wall, loadBytes / wall / 1e6);
+	printLatency("latency", &loadLatency);
+	if(rate > 0)
+		printLatency("service", &loadService);
+
+	return (loadErrors > 0 || loadInFlight > 0) ? 1 : 0;
+}
+
+// Parses size[:weight],... into loadSizes, returns 0 if it is malformed
+static int parseSizes(char* argument)
+{
+	char* save;
+	char* entry;
+	for(entry = strtok_r(argument, ",", &save); entry != NULL; entry = strtok_r(NULL, ",", &save))
+	{
+		if(loadSizeCount == LOAD_MAX_SIZES)
+			return 0;
+
+		char* rest;
+		struct loadSize* size = &loadSizes[loadSizeCount];
+		size->bytes = strtoull(entry, &rest, 10);
+		size->weight = 1;
+		if(*rest == ':')
+			size->weight = strtoul(rest + 1, &rest, 10);
+		if(*rest != '\0' || size->bytes == 0 || size->weight == 0)
+			return 0;
+
+		loadWeightTotal += size->weight;
+		loadSizeCount++;
+	}
+	return loadSizeCount > 0;
+}
+
+// Builds the bytes a client sends for one request of this size: the
+// legacy id and '?' terminated packages, or alternating chunk pairs and END
+static void buildWire(struct loadSize* size, int legacy, int handshakeId)
+{
+	size_t n = size->bytes;
+	size_t chunks = (n + OTP_CHUNK_SIZE - 1) / OTP_CHUNK_SIZE;
+	size_t length = legacy ? 4 + n + 1 + (1023 - n % 1024) + n + 1
+		: 2 * n + (2 * chunks + 1) * OTP_HEADER_SIZE;
+
+	char* wire = malloc(length);
+	if(wire == NULL)
+	{
+		fprintf(stderr,"Unable to allocate a %zu byte request.\n", n);
+		exit(1);
+	}
+
+	// any valid symbols will do; the daemons transform whatever they get
+	char* text = malloc(n);
+	char* key = malloc(n);
+	if(text == NULL || key == NULL)
+	{
+		fprintf(stderr,"Unable to allocate a %zu byte request.\n", n);
+		exit(1);
+	}
+	size_t i;
+	for(i = 0; i < n; i++)
+	{
+		text[i] = otpSymbolChar[(i * 7 + 3) % 27];
+		key[i] = otpSymbolChar[(i * 11 + 5) % 27];
+	}
+
+	char* at = wire;
+	if(legacy)
+	{
+		// same layout otp_enc sent: id, text, '?', padded out to its 1024 byte block, key, '?'
+		snprintf(at, 5, "%04d", handshakeId);
+		at += 4;
+		memcpy(at, text, n);
+		at += n;
+		*at++ = '?';
+		memset(at, 0, 1023 - n % 1024);
+		at += 1023 - n % 1024;
+		memcpy(at, key, n);
+		at += n;
+		*at++ = '?';
+	}
+	else
+	{
+		// one request at a time per connection, so every request can use id 1
+		size_t offset;
+		for(offset = 0; offset < n; offset += OTP_CHUNK_SIZE)
+		{
+			size_t chunk = (n - offset < OTP_CHUNK_SIZE) ? n - offset : OTP_CHUNK_SIZE;
+			struct otpFrameHeader textHeader = { OTP_FRAME_TEXT_CHUNK, 0, 1, chunk };
+			struct otpFrameHeader keyHeader = { OTP_FRAME_KEY_CHUNK, 0, 1, chunk };
+
+			otpPackHeader(at, &textHeader);
+			memcpy(at + OTP_HEADER_SIZE, text + offset, chunk);
+			at += OTP_HEADER_SIZE + chunk;
+			otpPackHeader(at, &keyHeader);
+			memcpy(at + OTP_HEADER_SIZE, key + offset, chunk);
+			at += OTP_HEADER_SIZE + chunk;
+		}
+		struct otpFrameHeader endHeader = { OTP_FRAME_END, 0, 1, 0 };
+		otpPackHeader(at, &endHeader);
+		at += OTP_HEADER_SIZE;
+	}
+
+	size->wire = wire;
+	size->wireLength = at - wire;
+	free(text);
+	free(key);
+}
+
+// Connects (and for the framed protocol, handshakes) and makes the socket non-blocking
+static void openConnection(struct loadConn* conn, int index)
+{
+	// a busy daemon is retried the way otp_enc would; legacy clients it
+	// turns away are closed, which counts as an error
+	conn->fd = loadLegacy ? otpConnect(loadAddress) : otpOpen(loadAddress, loadHandshakeId, 0);
+	if(conn->fd < 0)
+	{
+		fprintf(stderr,"otp_load: daemon on %s does not accept handshake id %d.\n", loadAddress, loadHandshakeId);
+		exit(2);
+	}
+	fcntl(conn->fd, F_SETFL, fcntl(conn->fd, F_GETFL) | O_NONBLOCK);
+	conn->writing = 0;
+	watch(conn, index, EPOLL_CTL_ADD, 0);
+}
+
+static void closeConnection(struct loadConn* conn)
+{
+	close(conn->fd);	// also drops it from the epoll set
+	conn->fd = -1;
+}
+
+// Sends the next request on an idle connection, a new one for the legacy protocol
+static void startRequest(struct loadConn* conn, int index, uint64_t intended, uint64_t now)
+{
+	if(conn->fd < 0)
+		openConnection(conn, index);
+
+	conn->busy = 1;
+	conn->size = pickSize();
+	conn->sent = 0;
+	conn->intended = intended;
+	conn->started = now;
+	conn->headerGot = 0;
+	conn->payloadLeft = 0;
+	conn->error = 0;
+	conn->handshakeSeen = 0;
+	loadInFlight++;
+
+	if(!sendRequest(conn, index))
+		failRequest(conn, index);
+}
+
+// Sends as much of the request as the socket takes, watching for
+// EPOLLOUT while some is left. Returns 0 if the connection failed
+static int sendRequest(struct loadConn* conn, int index)
+{
+	const struct loadSize* size = conn->size;
+	while(conn->sent < size->wireLength)
+	{
+		ssize_t n = send(conn->fd, size->wire + conn->sent, size->wireLength - conn->sent, MSG_NOSIGNAL);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if(n < 0)
+			return 0;
+		conn->sent += n;
+	}
+
+	int writing = (conn->sent < size->wireLength);
+	if(writing != conn->writing)
+		watch(conn, index, EPOLL_CTL_MOD, writing);
+	return 1;
+}
+
+// Reads what has arrived. Returns 1 once the whole answer is in, 0 if
+// more is to come, -1 if the connection failed or the daemon refused
+static int receiveAnswer(struct loadConn* conn)
+{
+	while(1)
+	{
+		ssize_t n = recv(conn->fd, loadScratch, sizeof(loadScratch), 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return 0;
+		if(n <= 0)
+			return -1;
+
+		int status = loadLegacy ? parseLegacy(conn, loadScratch, n) : parseFramed(conn, loadScratch, n);
+		if(status != 0)
+			return status;
+	}
+}
+
+// Walks RESULT_CHUNK frames, discarding their payload, up to the END
+static int parseFramed(struct loadConn* conn, const char* data, size_t length)
+{
+	while(length > 0)
+	{
+		if(conn->payloadLeft > 0)
+		{
+			size_t used = (conn->payloadLeft < length) ? conn->payloadLeft : length;
+			conn->payloadLeft -= used;
+			data += used;
+			length -= used;
+			if(conn->payloadLeft == 0 && conn->error)
+				return -1;
+			continue;
+		}
+
+		size_t used = OTP_HEADER_SIZE - conn->headerGot;
+		if(used > length)
+			used = length;
+		memcpy(conn->header + conn->headerGot, data, used);
+		conn->headerGot += used;
+		data += used;
+		length -= used;
+		if(conn->headerGot < OTP_HEADER_SIZE)
+			break;
+
+		struct otpFrameHeader header;
+		otpUnpackHeader(conn->header, &header);
+		conn->headerGot = 0;
+		if(header.type == OTP_FRAME_END)
+			return 1;
+		if(header.type == OTP_FRAME_ERROR)
+			conn->error = 1;
+		else if(header.type != OTP_FRAME_RESULT_CHUNK)
+			return -1;
+		conn->payloadLeft = header.length;
+		if(conn->error && header.length == 0)
+			return -1;
+	}
+	return 0;
+}
+
+// Checks the handshake response, then looks for the '?' that ends the result
+static int parseLegacy(struct loadConn* conn, const char* data, size_t length)
+{
+	if(!conn->handshakeSeen)
+	{
+		if(data[0] == '0')
+		{
+			fprintf(stderr,"otp_load: daemon on %s does not accept handshake id %d.\n", loadAddress, loadHandshakeId);
+			exit(2);
+		}
+		if(data[0] != '1')
+			return -1;
+		conn->handshakeSeen = 1;
+		data++;
+		length--;
+	}
+	return memchr(data, '?', length) != NULL;
+}
+
+// Records a completed request and frees its connection
+static void finishRequest(struct loadConn* conn, int index, uint64_t now)
+{
+	otpHistogramRecord(&loadLatency, now - conn->intended);
+	otpHistogramRecord(&loadService, now - conn->started);
+	loadCompleted++;
+	loadBytes += conn->size->bytes;
+
+	conn->busy = 0;
+	loadInFlight--;
+	if(loadLegacy)
+		closeConnection(conn);
+	loadIdle[loadIdleCount++] = index;
+}
+
+// Counts a failed request and starts the connection over
+static void failRequest(struct loadConn* conn, int index)
+{
+	loadErrors++;
+	conn->busy = 0;
+	loadInFlight--;
+	closeConnection(conn);
+	if(!loadLegacy)
+		openConnection(conn, index);
+	loadIdle[loadIdleCount++] = index;
+}
+
+// Adds the connection to the epoll set or changes whether it waits to write
+static void watch(struct loadConn* conn, int index, int op, int writing)
+{
+	struct epoll_event event;
+	event.events = EPOLLIN | (writing ? EPOLLOUT : 0);
+	event.data.u64 = 0;
+	event.data.u32 = index;
+	if(epoll_ctl(loadEpollFD, op, conn->fd, &event) < 0)
+	{
+		perror("epoll_ctl");
+		exit(1);
+	}
+	conn->writing = writing;
+}
+
+// Draws a size from the mix (xorshift64, in proportion to the weights)
+static const struct loadSize* pickSize()
+{
+	if(loadSizeCount == 1)
+		return &loadSizes[0];
+
+	loadRandom ^= loadRandom << 13;
+	loadRandom ^= loadRandom >> 7;
+	loadRandom ^= loadRandom << 17;
+	unsigned pick = loadRandom % loadWeightTotal;
+
+	int i;
+	for(i = 0; pick >= loadSizes[i].weight; i++)
+		pick -= loadSizes[i].weight;
+	return &loadSizes[i];
+}
+
+static void printLatency(const char* label, const struct otpHistogram* histogram)
+{
+	double mean = histogram->count ? (double)histogram->sum / histogram->count : 0;
+	printf("%-11s mean %.1f us, p50 %.1f us, p99 %.1f us, p99.9 %.1f us, max %.1f us\n", label, mean / 1e3,
+		otpHistogramPercentile(histogram, 0.50) / 1e3, otpHistogramPercentile(histogram, 0.99) / 1e3,
+		otpHistogramPercentile(histogram, 0.999) / 1e3, histogram->max / 1e3);
+}
+
+// monotonic wall clock in nanoseconds
+static uint64_t nowNs()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_codec.h"
+#include "otp_client.h"
+#include "otp_local.h"
+
+// forward declarations
+static int writeMapped(struct otpContext* context, int outFD, const char* text, const char* key, size_t length);
+static int writeChunked(struct otpContext* context, int outFD, const char* text, const char* key, size_t length);
+
+void otpContextInit(struct otpContext* context, enum otpDirection direction)
+{
+	otpCodecInit();
+	context->transform = (direction == OTP_XOR) ? otpXor : (direction == OTP_ENCRYPT) ? otpEncode : otpDecode;
+	context->binary = (direction == OTP_XOR);
+	context->scratch = NULL;
+	context->invalid = -1;
+}
+
+int otpContextRun(struct otpContext* context, char* out, const char* text, const char* key, size_t length)
+{
+	if(context->binary)
+	{
+		context->transform(out, text, key, length);
+		return 0;
+	}
+
+	size_t valid = otpValidate(text, length);
+	if(valid != length)
+	{
+		context->invalid = valid;
+		return OTP_LOCAL_INVALID_TEXT;
+	}
+	valid = otpValidate(key, length);
+	if(valid != length)
+	{
+		context->invalid = valid;
+		return OTP_LOCAL_INVALID_KEY;
+	}
+	context->transform(out, text, key, length);
+	return 0;
+}
+
+int otpContextRunFD(struct otpContext* context, int outFD, int textFD, int keyFD)
+{
+	struct otpInput text, key;
+
+	// mapping validates both, up to their newlines, side by side
+	int keyStatus;
+	int textStatus = otpMapInputsFD(textFD, &text, keyFD, &key, &keyStatus, context->binary);
+	if(textStatus == -1)
+		return -1;
+
+	int status = 0;
+	if(textStatus == -3)
+	{
+		context->invalid = text.invalid;
+		status = OTP_LOCAL_INVALID_TEXT;
+	}
+	else if(keyStatus == -1)
+		status = -1;
+	else if(keyStatus == -3)
+	{
+		context->invalid = key.invalid;
+		status = OTP_LOCAL_INVALID_KEY;
+	}
+	else if(text.length > key.length)
+		status = OTP_LOCAL_SHORT_KEY;
+	else
+	{
+		status = writeMapped(context, outFD, text.data, key.data, text.length);
+		if(status > 0)
+			status = writeChunked(context, outFD, text.data, key.data, text.length);
+	}
+
+	int saved = errno;
+	if(keyStatus != -1)
+		otpUnmapInput(&key);
+	otpUnmapInput(&text);
+	errno = saved;
+	return status;
+}
+
+void otpContextFree(struct otpContext* context)
+{
+	free(context->scratch);
+	context->scratch = NULL;
+}
+
+// Transforms straight into a mapping of outFD, when it is a regular file
+// open for reading and writing. Returns 0, -1 on error, or 1 if the
+// output cannot be mapped and has to be written instead
+static int writeMapped(struct otpContext* context, int outFD, const char* text, const char* key, size_t length)
+{
+	struct stat info;
+	int flags = fcntl(outFD, F_GETFL);
+	if(flags < 0 || (flags & O_ACCMODE) != O_RDWR || fstat(outFD, &info) < 0 || !S_ISREG(info.st_mode))
+		return 1;
+
+	// appending writes at the end whatever the offset says
+	off_t offset = (flags & O_APPEND) ? info.st_size : lseek(outFD, 0, SEEK_CUR);
+	if(offset < 0)
+		return 1;
+
+	// grow the file to hold the result (and its newline), never shrink it;
+	// allocated blocks spare the page faults below from allocating them
+	size_t total = length + !context->binary;
+	if(info.st_size < offset + (off_t)total && fallocate(outFD, 0, offset, total) < 0
+		&& ftruncate(outFD, offset + total) < 0)
+		return 1;
+
+	// mappings start on a page boundary; every page will be written, so
+	// fault them all in up front rather than one at a time
+	off_t aligned = offset & ~((off_t)sysconf(_SC_PAGESIZE) - 1);
+	size_t lead = offset - aligned;
+	char* mapping = mmap(NULL, lead + total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, outFD, aligned);
+	if(mapping == MAP_FAILED)
+	{
+		if(info.st_size < offset + (off_t)total)
+			ftruncate(outFD, info.st_size);
+		return 1;
+	}
+
+	context->transform(mapping + lead, text, key, length);
+	if(!context->binary)
+		mapping[lead + length] = '\n';
+	munmap(mapping, lead + total);
+
+	// as if the result had been written
+	if(!(flags & O_APPEND) && lseek(outFD, offset + total, SEEK_SET) < 0)
+		return -1;
+	return 0;
+}
+
+// Transforms a cache sized chunk at a time into scratch and writes it
+// returns 0, or -1 on error
+static int writeChunked(struct otpContext* context, int outFD, const char* text, const char* key, size_t length)
+{
+	if(context->scratch == NULL)
+	{
+		context->scratch = malloc(OTP_LOCAL_CHUNK + 1);
+		if(context->scratch == NULL)
+			return -1;
+	}
+
+	size_t done = 0;
+	do
+	{
+		size_t chunk = (length - done < OTP_LOCAL_CHUNK) ? length - done : OTP_LOCAL_CHUNK;
+		context->transform(context->scratch, text + done, key + done, chunk);
+		done += chunk;
+
+		// the newline rides with the last chunk
+		size_t pending = chunk;
+		if(done == length && !context->binary)
+			context->scratch[pending++] = '\n';
+
+		const char* from = context->scratch;
+		while(pending > 0)
+		{
+			ssize_t written = write(outFD, from, pending);
+			if(written < 0 && errno == EINTR)
+				continue;
+			if(written < 0)
+				return -1;
+			from += written;
+			pending -= written;
+		}
+	}
+	while(done < length);
+	return 0;
+}
@@ -0,0 +1,53 @@
+#ifndef OTP_LOCAL_H
+#define OTP_LOCAL_H
+
+#include <stddef.h>
+
+// In-process encryption and decryption (libotp), the transform the
+// daemons run, for data that never has to leave the host. Nothing is
+// sent anywhere and nothing is copied that need not be: buffers are
+// transformed in place of the caller's choosing, files through mmap.
+
+// which way a context transforms
+enum otpDirection
+{
+	OTP_ENCRYPT,
+	OTP_DECRYPT,
+	OTP_XOR			// binary mode, both ways: raw bytes, unchecked, no newline
+};
+
+// results other than 0 (-1 means errno is set)
+#define OTP_LOCAL_SHORT_KEY		-2	// key has fewer symbols than the text
+#define OTP_LOCAL_INVALID_TEXT	-3	// text holds a byte that is not 'A'-'Z' or space
+#define OTP_LOCAL_INVALID_KEY	-4	// so does the key
+
+// symbols transformed per write when the output cannot be mapped
+#define OTP_LOCAL_CHUNK (1024 * 1024)
+
+struct otpContext
+{
+	void (*transform)(char* out, const char* text, const char* key, size_t len);
+	char* scratch;			// a chunk and its newline, allocated on first use
+	int binary;				// OTP_XOR
+	long long invalid;		// offset of the first invalid byte, after OTP_LOCAL_INVALID_ results
+};
+
+// Sets up a context, selecting the codec kernel for this CPU
+void otpContextInit(struct otpContext* context, enum otpDirection direction);
+
+// Validates length symbols of text and key (unless binary), then writes
+// the result to out (which may be text). Returns 0 or an OTP_LOCAL_ code
+int otpContextRun(struct otpContext* context, char* out, const char* text, const char* key, size_t length);
+
+// Transforms the text in textFD (up to its first newline) with the key in
+// keyFD and writes the result and a newline to outFD, at its current
+// offset, as otp_enc / otp_dec print it. Regular files are mapped; so is
+// a regular output file open for reading and writing, which is extended
+// to fit and written in place. A binary context uses the whole text and
+// writes no newline. Returns 0 or an OTP_LOCAL_ code
+int otpContextRunFD(struct otpContext* context, int outFD, int textFD, int keyFD);
+
+// Releases what the context allocated
+void otpContextFree(struct otpContext* context);
+
+#endif
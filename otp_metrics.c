@@ -0,0 +1,210 @@
+#include <stdio.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "otp_metrics.h"
+
+// most of a request the admin endpoint reads before answering anyway
+#define OTP_ADMIN_REQUEST_MAX 4096
+
+// a scraper that connects and says nothing is dropped after this long
+#define OTP_ADMIN_TIMEOUT_SECONDS 1
+
+// exported histogram bucket bounds, in seconds; each of our buckets is
+// counted under the first bound its values do not exceed (to within its
+// own precision)
+static const double phaseBounds[] =
+{
+	1e-6, 2.5e-6, 5e-6, 1e-5, 2.5e-5, 5e-5, 1e-4, 2.5e-4, 5e-4,
+	1e-3, 2.5e-3, 5e-3, 1e-2, 2.5e-2, 5e-2, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static const char* phaseNames[OTP_PHASES] = { "handshake", "receive", "transform", "send" };
+
+// forward declarations
+static int appendf(struct otpBuffer* out, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static int formatCounter(struct otpBuffer* out, const struct otpMetrics* metrics, int slots, const char* daemon,
+	const char* name, const char* type, const char* help, size_t offset);
+static void answerScrape(int clientFD, struct otpBuffer* body, const struct otpMetrics* metrics, int slots, const char* daemon);
+
+struct otpMetrics* otpMetricsCreate(int slots)
+{
+	// anonymous shared memory comes zeroed and survives fork() shared
+	void* region = mmap(NULL, slots * sizeof(struct otpMetrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	return (region == MAP_FAILED) ? NULL : region;
+}
+
+int otpMetricsFormat(struct otpBuffer* out, const struct otpMetrics* metrics, int slots, const char* daemon)
+{
+	if(!formatCounter(out, metrics, slots, daemon, "otp_connections_accepted_total", "counter",
+			"Connections accepted.", offsetof(struct otpMetrics, accepted))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_handshakes_rejected_total", "counter",
+			"Handshakes refused for the wrong client id.", offsetof(struct otpMetrics, rejected))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_connections_busy_total", "counter",
+			"Clients turned away at a connection or in-flight limit.", offsetof(struct otpMetrics, busy))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_connections_expired_total", "counter",
+			"Connections closed for missing an idle, read or write deadline.", offsetof(struct otpMetrics, expired))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_requests_total", "counter",
+			"Requests answered.", offsetof(struct otpMetrics, requests))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_received_bytes_total", "counter",
+			"Bytes received from clients.", offsetof(struct otpMetrics, bytesIn))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_sent_bytes_total", "counter",
+			"Bytes sent to clients.", offsetof(struct otpMetrics, bytesOut))
+		|| !formatCounter(out, metrics, slots, daemon, "otp_connections_active", "gauge",
+			"Connections open now.", offsetof(struct otpMetrics, active)))
+		return 0;
+
+	if(!appendf(out, "# HELP otp_phase_seconds Time spent in each phase of serving a request.\n"
+			"# TYPE otp_phase_seconds histogram\n"))
+		return 0;
+
+	int slot, phase;
+	for(slot = 0; slot < slots; slot++)
+	{
+		for(phase = 0; phase < OTP_PHASES; phase++)
+		{
+			const struct otpHistogram* histogram = &metrics[slot].phases[phase];
+			uint64_t cumulative = 0;
+			int bucket = 0;
+			size_t b;
+
+			// our buckets are far finer than the exported ones; fold them in order
+			for(b = 0; b < sizeof(phaseBounds) / sizeof(phaseBounds[0]); b++)
+			{
+				uint64_t boundNs = (uint64_t)(phaseBounds[b] * 1e9 + 0.5);
+				while(bucket < OTP_HIST_BUCKETS && otpHistogramBucketMax(bucket) <= boundNs)
+					cumulative += histogram->buckets[bucket++];
+				if(!appendf(out, "otp_phase_seconds_bucket{daemon=\"%s\",worker=\"%d\",phase=\"%s\",le=\"%g\"} %llu\n",
+						daemon, slot, phaseNames[phase], phaseBounds[b], (unsigned long long)cumulative))
+					return 0;
+			}
+
+			uint64_t count = histogram->count;
+			if(!appendf(out, "otp_phase_seconds_bucket{daemon=\"%s\",worker=\"%d\",phase=\"%s\",le=\"+Inf\"} %llu\n"
+					"otp_phase_seconds_sum{daemon=\"%s\",worker=\"%d\",phase=\"%s\"} %.9f\n"
+					"otp_phase_seconds_count{daemon=\"%s\",worker=\"%d\",phase=\"%s\"} %llu\n",
+					daemon, slot, phaseNames[phase], (unsigned long long)count,
+					daemon, slot, phaseNames[phase], histogram->sum / 1e9,
+					daemon, slot, phaseNames[phase], (unsigned long long)count))
+				return 0;
+		}
+	}
+	return 1;
+}
+
+void otpMetricsServe(int listenSocketFD, const struct otpMetrics* metrics, int slots, const char* daemon, volatile sig_atomic_t* keepRunning)
+{
+	struct otpBuffer body = { NULL, 0, 0 };
+
+	// one scrape at a time: each is a few hundred microseconds of formatting
+	while(*keepRunning)
+	{
+		int clientFD = accept(listenSocketFD, NULL, NULL);
+		if(clientFD < 0)
+		{
+			if(errno != EINTR && errno != ECONNABORTED)
+				perror("Error on admin accept");
+			continue;
+		}
+		answerScrape(clientFD, &body, metrics, slots, daemon);
+		close(clientFD);
+	}
+	otpBufferFree(&body);
+}
+
+// Reads the request (whatever it asks for, the answer is the metrics) and sends the metrics
+static void answerScrape(int clientFD, struct otpBuffer* body, const struct otpMetrics* metrics, int slots, const char* daemon)
+{
+	struct timeval timeout = { OTP_ADMIN_TIMEOUT_SECONDS, 0 };
+	setsockopt(clientFD, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(clientFD, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	// up to the blank line that ends the request headers; reading it all
+	// keeps close() from resetting the connection under the answer
+	char request[OTP_ADMIN_REQUEST_MAX + 1];
+	size_t got = 0;
+	while(got < OTP_ADMIN_REQUEST_MAX)
+	{
+		ssize_t n = recv(clientFD, request + got, OTP_ADMIN_REQUEST_MAX - got, 0);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return;
+		got += n;
+		request[got] = '\0';
+		if(strstr(request, "\r\n\r\n") != NULL || strstr(request, "\n\n") != NULL)
+			break;
+	}
+
+	body->length = 0;
+	if(!otpMetricsFormat(body, metrics, slots, daemon))
+		return;
+
+	char head[128];
+	int headLength = snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+		"Content-Length: %zu\r\n\r\n", body->length);
+
+	const char* parts[2] = { head, body->data };
+	size_t lengths[2] = { (size_t)headLength, body->length };
+	int i;
+	for(i = 0; i < 2; i++)
+	{
+		size_t sent = 0;
+		while(sent < lengths[i])
+		{
+			ssize_t n = send(clientFD, parts[i] + sent, lengths[i] - sent, MSG_NOSIGNAL);
+			if(n < 0 && errno == EINTR)
+				continue;
+			if(n < 0)
+				return;
+			sent += n;
+		}
+	}
+}
+
+// One counter (or gauge) for every worker, read from the field at offset
+static int formatCounter(struct otpBuffer* out, const struct otpMetrics* metrics, int slots, const char* daemon,
+	const char* name, const char* type, const char* help, size_t offset)
+{
+	if(!appendf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type))
+		return 0;
+
+	int slot;
+	for(slot = 0; slot < slots; slot++)
+	{
+		const uint64_t* field = (const uint64_t*)((const char*)&metrics[slot] + offset);
+		uint64_t value = __atomic_load_n(field, __ATOMIC_RELAXED);
+		if(!appendf(out, "%s{daemon=\"%s\",worker=\"%d\"} %llu\n", name, daemon, slot, (unsigned long long)value))
+			return 0;
+	}
+	return 1;
+}
+
+// printf onto the end of out, growing it as needed. Returns 0 if memory ran out
+static int appendf(struct otpBuffer* out, const char* format, ...)
+{
+	if(!otpBufferReserve(out, out->length + 1, OTP_BUFFER_UNLIMITED))
+		return 0;
+	while(1)
+	{
+		size_t room = out->capacity - out->length;
+		va_list args;
+		va_start(args, format);
+		int n = vsnprintf(out->data + out->length, room, format, args);
+		va_end(args);
+		if(n < 0)
+			return 0;
+		if((size_t)n < room)
+		{
+			out->length += n;
+			return 1;
+		}
+		if(!otpBufferReserve(out, out->length + n + 1, OTP_BUFFER_UNLIMITED))
+			return 0;
+	}
+}
@@ -0,0 +1,69 @@
+#ifndef OTP_METRICS_H
+#define OTP_METRICS_H
+
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include "otp_histogram.h"
+#include "otp_buffer.h"
+
+// Daemon metrics (libotp). Each worker owns one otpMetrics slot in a
+// mapping shared with the rest of the pool and is its only writer, so
+// nothing is locked: counters are updated with relaxed atomic stores a
+// reader in another process always sees whole. A scrape that lands in the
+// middle of a histogram update may be one request behind; nothing is lost.
+
+// where a request's time goes, each recorded in nanoseconds
+enum otpPhase
+{
+	OTP_PHASE_HANDSHAKE,	// connection accepted until its id is checked
+	OTP_PHASE_RECEIVE,		// first frame (or package) of a request until its last
+	OTP_PHASE_TRANSFORM,	// encoding / decoding, summed over a request
+	OTP_PHASE_SEND,			// request complete until its answer has gone out
+	OTP_PHASES
+};
+
+struct otpMetrics
+{
+	uint64_t accepted;		// connections accepted
+	uint64_t rejected;		// handshakes with the wrong id
+	uint64_t busy;			// clients turned away at an admission limit
+	uint64_t expired;		// connections closed for missing a deadline
+	uint64_t requests;		// requests answered
+	uint64_t bytesIn;
+	uint64_t bytesOut;
+	uint64_t active;		// connections open now
+	struct otpHistogram phases[OTP_PHASES];
+};
+
+static inline void otpMetricAdd(uint64_t* counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static inline void otpMetricSub(uint64_t* counter, uint64_t n)
+{
+	__atomic_store_n(counter, *counter - n, __ATOMIC_RELAXED);
+}
+
+// monotonic clock in nanoseconds, for phase timings
+static inline uint64_t otpMetricsNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Maps zeroed slots for every worker, shared with processes forked
+// afterwards. Returns NULL if the mapping fails
+struct otpMetrics* otpMetricsCreate(int slots);
+
+// Appends every slot to out in the Prometheus text format, labelled with
+// the daemon's name and the worker. Returns 0 if memory ran out
+int otpMetricsFormat(struct otpBuffer* out, const struct otpMetrics* metrics, int slots, const char* daemon);
+
+// Answers each connection on listenSocketFD (an HTTP GET, typically from
+// Prometheus) with the current metrics until *keepRunning drops to 0
+void otpMetricsServe(int listenSocketFD, const struct otpMetrics* metrics, int slots, const char* daemon, volatile sig_atomic_t* keepRunning);
+
+#endif
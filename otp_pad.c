@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "otp_codec.h"
+#include "otp_pad.h"
+
+// forward declarations
+static int loadPad(struct otpPad* pad, int directoryFD, const char* name);
+static int comparePads(const void* a, const void* b);
+
+int otpPadStoreOpen(struct otpPadStore* store, const char* directory)
+{
+	store->pads = NULL;
+	store->count = 0;
+
+	DIR* dir = opendir(directory);
+	if(dir == NULL)
+	{
+		perror(directory);
+		return -1;
+	}
+
+	size_t capacity = 0;
+	struct dirent* entry;
+	while((entry = readdir(dir)) != NULL)
+	{
+		if(entry->d_name[0] == '.')
+			continue;
+		if(strlen(entry->d_name) > OTP_PAD_NAME_MAX)
+		{
+			fprintf(stderr,"Pad name too long: %s\n", entry->d_name);
+			continue;
+		}
+
+		if(store->count == capacity)
+		{
+			capacity = (capacity > 0) ? capacity * 2 : 16;
+			struct otpPad* grown = realloc(store->pads, capacity * sizeof(struct otpPad));
+			if(grown == NULL)
+			{
+				fprintf(stderr,"Unable to allocate pad list.\n");
+				closedir(dir);
+				otpPadStoreClose(store);
+				return -1;
+			}
+			store->pads = grown;
+		}
+
+		int loaded = loadPad(&store->pads[store->count], dirfd(dir), entry->d_name);
+		if(loaded < 0)
+		{
+			closedir(dir);
+			otpPadStoreClose(store);
+			return -1;
+		}
+		if(loaded > 0)
+			store->count++;
+	}
+	closedir(dir);
+
+	// sorted, so a lookup is a binary search
+	if(store->count > 0)
+		qsort(store->pads, store->count, sizeof(struct otpPad), comparePads);
+	return 0;
+}
+
+const struct otpPad* otpPadFind(const struct otpPadStore* store, const char* name, size_t nameLength)
+{
+	size_t low = 0, high = store->count;
+
+	while(low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		const char* candidate = store->pads[middle].name;
+		size_t candidateLength = strlen(candidate);
+
+		// same order as strcmp, but name may hold any bytes
+		int order = memcmp(candidate, name, (candidateLength < nameLength) ? candidateLength : nameLength);
+		if(order == 0 && candidateLength != nameLength)
+			order = (candidateLength < nameLength) ? -1 : 1;
+
+		if(order == 0)
+			return &store->pads[middle];
+		if(order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return NULL;
+}
+
+void otpPadStoreClose(struct otpPadStore* store)
+{
+	size_t i;
+	for(i = 0; i < store->count; i++)
+	{
+		if(store->pads[i].size > 0)
+			munmap((void*)store->pads[i].data, store->pads[i].size);
+		free(store->pads[i].name);
+	}
+	free(store->pads);
+	store->pads = NULL;
+	store->count = 0;
+}
+
+// Maps one pad file and checks its key symbols
+// returns 1 if it was loaded, 0 if it is not a regular file, -1 on error
+static int loadPad(struct otpPad* pad, int directoryFD, const char* name)
+{
+	int fd = openat(directoryFD, name, O_RDONLY);
+	if(fd < 0)
+	{
+		perror(name);
+		return -1;
+	}
+
+	struct stat info;
+	if(fstat(fd, &info) < 0 || !S_ISREG(info.st_mode))
+	{
+		close(fd);
+		return 0;
+	}
+
+	pad->data = "";
+	pad->size = 0;
+	if(info.st_size > 0)
+	{
+		// shared and read only: every worker sees the same page cache pages
+		void* mapping = mmap(NULL, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if(mapping == MAP_FAILED)
+		{
+			perror(name);
+			close(fd);
+			return -1;
+		}
+		pad->data = mapping;
+		pad->size = info.st_size;
+	}
+	close(fd);
+
+	// a pad is a keygen key: symbols up to the first newline
+	const char* newline = (pad->size > 0) ? memchr(pad->data, '\n', pad->size) : NULL;
+	pad->length = (newline != NULL) ? (size_t)(newline - pad->data) : pad->size;
+	if(otpValidate(pad->data, pad->length) != pad->length)
+	{
+		fprintf(stderr,"Invalid character in pad %s.\n", name);
+		if(pad->size > 0)
+			munmap((void*)pad->data, pad->size);
+		return -1;
+	}
+
+	pad->name = strdup(name);
+	if(pad->name == NULL)
+	{
+		if(pad->size > 0)
+			munmap((void*)pad->data, pad->size);
+		return -1;
+	}
+	return 1;
+}
+
+// qsort order for pads: by name
+static int comparePads(const void* a, const void* b)
+{
+	return strcmp(((const struct otpPad*)a)->name, ((const struct otpPad*)b)->name);
+}
@@ -0,0 +1,38 @@
+#ifndef OTP_PAD_H
+#define OTP_PAD_H
+
+#include <stddef.h>
+
+// Server-resident pads (libotp). A daemon started with a pad directory
+// maps every file in it once, before any workers are forked, so clients
+// can name a pad and an offset instead of sending key bytes and the
+// pages stay shared and cached across workers and requests.
+
+// longest pad name a client may send
+#define OTP_PAD_NAME_MAX 255
+
+struct otpPad
+{
+	char* name;				// file name within the directory
+	const char* data;		// read-only mapping of the whole file
+	size_t length;			// key symbols, up to the first newline
+	size_t size;			// bytes mapped
+};
+
+struct otpPadStore
+{
+	struct otpPad* pads;	// sorted by name
+	size_t count;
+};
+
+// Maps and validates every regular file in directory (skipping dot files)
+// returns 0, or -1 after printing why the directory could not be loaded
+int otpPadStoreOpen(struct otpPadStore* store, const char* directory);
+
+// Finds the pad called name (not terminated), NULL if there is none
+const struct otpPad* otpPadFind(const struct otpPadStore* store, const char* name, size_t nameLength);
+
+// Unmaps every pad
+void otpPadStoreClose(struct otpPadStore* store);
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef OTP_PROTO_H
+#define OTP_PROTO_H
+
+#include <stdint.h>
+#include <string.h>
+
+// Wire format of the framed protocol (version 2).
+//
+// Legacy clients open with their 4 digit id and send '?' terminated
+// packages. Framed clients open with the 4 byte preamble "OTP" + version
+// instead, which the daemon tells apart from a legacy id, followed by a
+// HELLO frame. Every frame is a 16 byte header and length payload bytes:
+//
+//   byte 0     frame type
+//   byte 1     flags
+//   bytes 2-3  reserved, 0
+//   bytes 4-7  request id, 32 bit big endian
+//   bytes 8-15 payload length, 64 bit big endian
+//
+// A connection stays open for as many requests as the client sends after
+// its HELLO. Every frame of a request carries the id the client picked
+// for it, the daemon tags its answers with the same id, and answers go
+// out in the order the requests arrived, so a client may send request
+// N+1 before the result of request N comes back.
+
+#define OTP_PROTOCOL_VERSION 2
+#define OTP_PREAMBLE_SIZE 4
+#define OTP_HEADER_SIZE 16
+
+static const char otpPreamble[OTP_PREAMBLE_SIZE] = { 'O', 'T', 'P', OTP_PROTOCOL_VERSION };
+
+// frame types
+enum otpFrameType
+{
+	OTP_FRAME_HELLO = 1,	// client: 4 byte big endian handshake id
+	OTP_FRAME_ACCEPT,		// server: handshake accepted, no payload
+	OTP_FRAME_DENY,			// server: wrong daemon for this client, no payload
+	OTP_FRAME_TEXT,			// client: the whole text
+	OTP_FRAME_KEY,			// client: the key, at least as long as the text
+	OTP_FRAME_RESULT,		// server: the transformed text
+	OTP_FRAME_ERROR,		// server: request refused, payload is a message
+	OTP_FRAME_TEXT_CHUNK,	// client: next piece of a streamed text
+	OTP_FRAME_KEY_CHUNK,	// client: next piece of a streamed key
+	OTP_FRAME_RESULT_CHUNK,	// server: result for the text and key received so far
+	OTP_FRAME_END,			// either side: streamed request / response complete
+	OTP_FRAME_KEY_REF,		// client: 8 byte big endian offset and the name of a pad the daemon holds
+	OTP_FRAME_BUSY			// server: too loaded to take this client now, no payload
+};
+
+// Streaming: instead of one TEXT and one KEY frame, a client may send
+// TEXT_CHUNK and KEY_CHUNK frames of at most OTP_CHUNK_SIZE bytes,
+// alternating so neither side runs more than OTP_STREAM_WINDOW ahead,
+// then END. The daemon answers each pair with a RESULT_CHUNK as soon as
+// both halves are in, and finishes with END, so its memory per
+// connection stays fixed however long the message is.
+#define OTP_CHUNK_SIZE (64 * 1024)
+#define OTP_STREAM_WINDOW (2 * OTP_CHUNK_SIZE)
+
+// Admission: a daemon at one of its limits answers the preamble with
+// BUSY instead of reading a HELLO, and the connection ends there. Nothing
+// was started, so the client may reconnect and try again after a pause.
+// Legacy clients have no such answer; they see the connection close.
+
+// Pads: a request that opens with KEY_REF uses the daemon's copy of a
+// pad, starting at the given offset, and then only sends its text (a
+// TEXT frame, or TEXT_CHUNK frames and END); no key bytes cross the wire.
+#define OTP_KEY_REF_OFFSET_SIZE 8
+
+// HELLO flags: modes the client asks for. The daemon's ACCEPT carries back
+// the ones it grants, which then hold for every request on the connection.
+//
+// Binary: texts, keys and results are raw bytes of any value, and the
+// transform is text XOR key in both directions, so nothing is validated
+// and the result is exactly as long as the text. Pads hold symbols, so a
+// binary connection has no KEY_REF.
+#define OTP_HELLO_BINARY 0x01
+
+struct otpFrameHeader
+{
+	uint8_t type;
+	uint8_t flags;
+	uint32_t request;
+	uint64_t length;
+};
+
+// 32 bit big endian helpers for the HELLO payload and request ids
+static inline void otpPack32(char* wire, uint32_t value)
+{
+	wire[0] = (char)(value >> 24);
+	wire[1] = (char)(value >> 16);
+	wire[2] = (char)(value >> 8);
+	wire[3] = (char)value;
+}
+
+static inline uint32_t otpUnpack32(const char* wire)
+{
+	return ((uint32_t)(uint8_t)wire[0] << 24) | ((uint32_t)(uint8_t)wire[1] << 16)
+		| ((uint32_t)(uint8_t)wire[2] << 8) | (uint32_t)(uint8_t)wire[3];
+}
+
+// 64 bit big endian helpers for lengths and pad offsets
+static inline void otpPack64(char* wire, uint64_t value)
+{
+	int i;
+	for(i = 0; i < 8; i++)
+		wire[i] = (char)(value >> (56 - 8 * i));
+}
+
+static inline uint64_t otpUnpack64(const char* wire)
+{
+	int i;
+	uint64_t value = 0;
+	for(i = 0; i < 8; i++)
+		value = (value << 8) | (uint8_t)wire[i];
+	return value;
+}
+
+// writes header into its 16 byte wire form
+static inline void otpPackHeader(char* wire, const struct otpFrameHeader* header)
+{
+	memset(wire, 0, OTP_HEADER_SIZE);
+	wire[0] = (char)header->type;
+	wire[1] = (char)header->flags;
+	otpPack32(wire + 4, header->request);
+	otpPack64(wire + 8, header->length);
+}
+
+// reads a header from its 16 byte wire form
+static inline void otpUnpackHeader(const char* wire, struct otpFrameHeader* header)
+{
+	header->type = (uint8_t)wire[0];
+	header->flags = (uint8_t)wire[1];
+	header->request = otpUnpack32(wire + 4);
+	header->length = otpUnpack64(wire + 8);
+}
+
+#endif
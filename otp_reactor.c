@@ -0,0 +1,348 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <stddef.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "otp_conn.h"
+
+// events handled per epoll_wait() call
+#define OTP_MAX_EVENTS 256
+
+// closed connections kept with their buffers for the next client
+#define OTP_SPARE_CONNECTIONS 64
+
+// reads handled for one connection before moving on to the next
+#define OTP_READS_PER_EVENT 16
+
+// one event loop, owned by a single worker
+struct otpReactor
+{
+	int epollFD;
+	int listenSocketFD;
+	const struct otpService* service;
+	const struct otpServerConfig* config;
+	struct otpMetrics* metrics;		// this worker's slot, or NULL
+	struct otpConnection* open;		// every connection being served
+	struct otpConnection* spare;	// closed connections ready for reuse
+	int spareCount;
+	struct otpLoad load;			// what the open connections hold, for admission
+	struct otpTimerWheel timers;	// every open connection's deadline
+	uint64_t now;					// wheel time when the last wait returned
+};
+
+// forward declarations
+static void acceptClients(struct otpReactor* reactor);
+static void handleInput(struct otpReactor* reactor, struct otpConnection* conn);
+static int flushOutput(struct otpReactor* reactor, struct otpConnection* conn);
+static void updateInterest(struct otpReactor* reactor, struct otpConnection* conn);
+static void closeConnection(struct otpReactor* reactor, struct otpConnection* conn);
+static void armDeadline(struct otpReactor* reactor, struct otpConnection* conn);
+static void expireConnections(struct otpReactor* reactor);
+
+void otpRunReactor(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	int listenSocketFD, volatile sig_atomic_t* keepRunning)
+{
+	struct otpReactor reactor;
+	struct epoll_event events[OTP_MAX_EVENTS];
+
+	memset(&reactor, 0, sizeof(reactor));
+	reactor.listenSocketFD = listenSocketFD;
+	reactor.service = service;
+	reactor.config = config;
+	reactor.metrics = metrics;
+	reactor.now = otpTimerNow();
+	otpTimerWheelInit(&reactor.timers, reactor.now);
+
+	reactor.epollFD = epoll_create1(EPOLL_CLOEXEC);
+	if(reactor.epollFD < 0)
+	{
+		perror("epoll_create1");
+		return;
+	}
+
+	// the listen socket is tagged with a NULL connection; EPOLLEXCLUSIVE keeps
+	// a pool of workers from all waking up for the same client
+	struct epoll_event listenEvent;
+	listenEvent.events = EPOLLIN | EPOLLEXCLUSIVE;
+	listenEvent.data.ptr = NULL;
+	if(epoll_ctl(reactor.epollFD, EPOLL_CTL_ADD, listenSocketFD, &listenEvent) < 0)
+	{
+		perror("epoll_ctl");
+		close(reactor.epollFD);
+		return;
+	}
+
+	// block until something is ready or a deadline is up, until SIGINT / SIGTERM
+	while(*keepRunning)
+	{
+		int ready = epoll_wait(reactor.epollFD, events, OTP_MAX_EVENTS, otpTimerTimeout(&reactor.timers, reactor.now));
+		reactor.now = otpTimerNow();
+		if(ready < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
+		}
+
+		int i;
+		for(i = 0; i < ready; i++)
+		{
+			struct otpConnection* conn = events[i].data.ptr;
+
+			if(conn == NULL)
+			{
+				acceptClients(&reactor);
+				continue;
+			}
+
+			// output first, so a finished connection can be closed before reading
+			if(events[i].events & EPOLLOUT)
+			{
+				if(flushOutput(&reactor, conn))
+					updateInterest(&reactor, conn);
+			}
+			else if(events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				handleInput(&reactor, conn);
+		}
+
+		expireConnections(&reactor);
+	}
+
+	// drop whatever is still open
+	while(reactor.open != NULL)
+		closeConnection(&reactor, reactor.open);
+	while(reactor.spare != NULL)
+	{
+		struct otpConnection* conn = reactor.spare;
+		reactor.spare = conn->next;
+		otpConnFree(conn);
+		free(conn);
+	}
+	close(reactor.epollFD);
+}
+
+// Accepts every client waiting on the listen socket
+static void acceptClients(struct otpReactor* reactor)
+{
+	while(1)
+	{
+		int establishedConnectionFD = accept4(reactor->listenSocketFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if(establishedConnectionFD < 0)
+		{
+			// EAGAIN: queue drained (or another worker got there first)
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR && errno != ECONNABORTED)
+				perror("Error on accept");
+			return;
+		}
+
+		// answers often end in a small frame (END) written after the data
+		// before it; without this, Nagle holds it for the client's delayed ACK.
+		// UNIX sockets have no Nagle to turn off
+		int noDelay = 1;
+		if(reactor->config->unixPath == NULL)
+			setsockopt(establishedConnectionFD, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+		// reuse a spare connection and its buffers if there is one
+		struct otpConnection* conn = reactor->spare;
+		if(conn != NULL)
+		{
+			reactor->spare = conn->next;
+			reactor->spareCount--;
+		}
+		else
+		{
+			conn = calloc(1, sizeof(struct otpConnection));
+			if(conn == NULL)
+			{
+				close(establishedConnectionFD);
+				continue;
+			}
+		}
+		otpConnReset(conn, reactor->service, reactor->config, reactor->metrics, establishedConnectionFD);
+		otpConnAdmit(conn, &reactor->load);
+		if(reactor->metrics != NULL)
+		{
+			otpMetricAdd(&reactor->metrics->accepted, 1);
+			otpMetricAdd(&reactor->metrics->active, 1);
+		}
+
+		// link into the open list
+		conn->prev = NULL;
+		conn->next = reactor->open;
+		if(reactor->open != NULL)
+			reactor->open->prev = conn;
+		reactor->open = conn;
+
+		updateInterest(reactor, conn);
+	}
+}
+
+// Reads whatever the client sent straight into the connection's window
+static void handleInput(struct otpReactor* reactor, struct otpConnection* conn)
+{
+	int reads;
+	for(reads = 0; reads < OTP_READS_PER_EVENT && otpConnReadable(conn); reads++)
+	{
+		char* window;
+		size_t room = otpConnWindow(conn, &window);
+
+		// readable but nowhere to put it: over a limit
+		if(room == 0)
+		{
+			closeConnection(reactor, conn);
+			return;
+		}
+
+		ssize_t received = recv(conn->fd, window, room, 0);
+		if(received == 0 || (received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+		{
+			// client hung up or the socket failed
+			closeConnection(reactor, conn);
+			return;
+		}
+		if(received < 0)
+			break;
+
+		if(!otpConnFeed(conn, window, received))
+		{
+			closeConnection(reactor, conn);
+			return;
+		}
+
+		// a handshake response or result is ready, get it out
+		const char* pending;
+		if(otpConnPending(conn, &pending) > 0 && !flushOutput(reactor, conn))
+			return;
+	}
+	updateInterest(reactor, conn);
+}
+
+// Sends as much pending output as the socket takes
+// returns 0 if the connection was finished (or failed) and has been closed
+static int flushOutput(struct otpReactor* reactor, struct otpConnection* conn)
+{
+	const char* pending;
+	size_t length;
+
+	while((length = otpConnPending(conn, &pending)) > 0)
+	{
+		ssize_t sent = send(conn->fd, pending, length, MSG_NOSIGNAL);
+		if(sent < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			if(errno == EINTR)
+				continue;
+			closeConnection(reactor, conn);
+			return 0;
+		}
+		otpConnSent(conn, sent);
+	}
+
+	if(otpConnFinished(conn))
+	{
+		closeConnection(reactor, conn);
+		return 0;
+	}
+	return 1;
+}
+
+// Registers for input while the connection wants it and for output while
+// there is unsent data, only calling epoll_ctl when that changes
+static void updateInterest(struct otpReactor* reactor, struct otpConnection* conn)
+{
+	const char* pending;
+	unsigned int wanted = 0;
+
+	// nothing left to read or write
+	if(otpConnFinished(conn))
+	{
+		closeConnection(reactor, conn);
+		return;
+	}
+
+	if(otpConnReadable(conn))
+		wanted |= EPOLLIN;
+	if(otpConnPending(conn, &pending) > 0)
+		wanted |= EPOLLOUT;
+
+	// whatever just happened on it counts as progress
+	armDeadline(reactor, conn);
+
+	if(wanted == conn->events)
+		return;
+
+	struct epoll_event event;
+	event.events = wanted;
+	event.data.ptr = conn;
+
+	// conn->events is 0 only before the first registration
+	int op = (conn->events == 0) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+	if(epoll_ctl(reactor->epollFD, op, conn->fd, &event) < 0)
+	{
+		closeConnection(reactor, conn);
+		return;
+	}
+	conn->events = wanted;
+}
+
+// Closes the socket and keeps the connection's buffers for the next client
+static void closeConnection(struct otpReactor* reactor, struct otpConnection* conn)
+{
+	close(conn->fd);	// also removes it from the epoll set
+	otpConnRelease(conn);
+	otpTimerCancel(&reactor->timers, &conn->deadline);
+	if(reactor->metrics != NULL)
+		otpMetricSub(&reactor->metrics->active, 1);
+
+	// unlink from the open list
+	if(conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		reactor->open = conn->next;
+	if(conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	if(reactor->spareCount < OTP_SPARE_CONNECTIONS)
+	{
+		conn->next = reactor->spare;
+		reactor->spare = conn;
+		reactor->spareCount++;
+	}
+	else
+	{
+		otpConnFree(conn);
+		free(conn);
+	}
+}
+
+// Restarts the deadline that applies to the connection now
+static void armDeadline(struct otpReactor* reactor, struct otpConnection* conn)
+{
+	unsigned int timeout = otpConnTimeout(conn);
+	if(timeout == 0)
+		otpTimerCancel(&reactor->timers, &conn->deadline);
+	else
+		otpTimerSchedule(&reactor->timers, &conn->deadline, reactor->now + timeout);
+}
+
+// Closes every connection whose deadline has passed
+static void expireConnections(struct otpReactor* reactor)
+{
+	struct otpTimer* due;
+	while((due = otpTimerExpire(&reactor->timers, reactor->now)) != NULL)
+	{
+		struct otpConnection* conn = (struct otpConnection*)((char*)due - offsetof(struct otpConnection, deadline));
+		if(reactor->metrics != NULL)
+			otpMetricAdd(&reactor->metrics->expired, 1);
+		closeConnection(reactor, conn);
+	}
+}
@@ -0,0 +1,492 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sched.h>
+#include <limits.h>
+#include "otp_conn.h"
+#include "otp_buffer.h"
+
+// error handler
+// takes msg to print and boolean for whether to use perror
+// or normal error output. (perror used when errno is set)
+static void error(const char *msg, int perrorOutput)
+{
+	if(perrorOutput)
+	{
+		perror(msg);
+		exit(1);
+	}
+	else
+	{
+		fprintf(stderr,"%s\n",msg);
+		exit(1);
+	}
+}
+
+// forward declarations
+static void parseTimeouts(const char* list, struct otpServerConfig* config);
+static int openListenSocket(int portNumber, int reusePort, int backlog);
+static int openUnixSocket(const char* path);
+static int openAdminSocket(const char* address);
+static void servePool(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	const int* listenSocketFDs, int listeners);
+static pid_t spawnWorker(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	int listenSocketFD, int shard);
+static pid_t spawnAdmin(const struct otpService* service, struct otpMetrics* metrics, int slots, const int* listenSocketFDs, int listeners);
+static int allowedCpus(cpu_set_t* allowed);
+static void pinToCpu(int shard);
+static void runWorker(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics, int listenSocketFD);
+static void catchSIGINT(int signo);
+
+// global flag to tell server to keep listening
+// set to 0 via SIGINT. Ensures that socket is closed.
+static volatile sig_atomic_t keepListening = 1;
+
+// for catching SIGINT
+static struct sigaction SIGINT_action = {0};
+
+// metrics endpoint, -1 without -a; only the admin process uses it
+static int adminSocketFD = -1;
+
+void otpServerParseArgs(int argc, char* argv[], struct otpServerConfig* config)
+{
+	int opt;
+
+	// defaults: a single event loop in this process
+	config->port = 0;
+	config->unixPath = NULL;
+	config->workers = 0;
+	config->packageLimit = OTP_BUFFER_UNLIMITED;
+	config->pads.pads = NULL;
+	config->pads.count = 0;
+	config->admin = NULL;
+	config->shards = 0;
+	config->uring = 0;
+	config->maxConnections = 0;
+	config->maxInFlight = 0;
+	config->backlog = SOMAXCONN;
+	config->idleTimeout = OTP_IDLE_TIMEOUT;
+	config->readTimeout = OTP_READ_TIMEOUT;
+	config->writeTimeout = OTP_WRITE_TIMEOUT;
+
+	while((opt = getopt(argc, argv, "w:m:p:a:sb:c:i:q:t:")) != -1)
+	{
+		switch(opt)
+		{
+			case 'w': // number of persistent workers
+				config->workers = atoi(optarg);
+				if(config->workers < 1)
+					error("Worker count must be at least 1.", 0);
+				break;
+			case 'm': // cap on whole TEXT / KEY frames, streams are not affected
+				config->packageLimit = strtoull(optarg, NULL, 10);
+				if(config->packageLimit < 1)
+					error("Package limit must be at least 1 byte.", 0);
+				break;
+			case 'p': // pad directory, mapped now so pool workers share it
+				otpPadStoreClose(&config->pads);
+				if(otpPadStoreOpen(&config->pads, optarg) < 0)
+					error("Unable to load pad directory.", 0);
+				break;
+			case 'a': // metrics endpoint: a local port or unix:<path>
+				config->admin = optarg;
+				break;
+			case 's': // a listen socket and a CPU for each worker
+				config->shards = 1;
+				break;
+			case 'b': // I/O backend
+				if(strcmp(optarg, "io_uring") == 0)
+					config->uring = 1;
+				else if(strcmp(optarg, "epoll") == 0)
+					config->uring = 0;
+				else
+					error("Backend must be epoll or io_uring.", 0);
+				break;
+			case 'c': // clients each event loop serves at once
+				config->maxConnections = atoi(optarg);
+				if(config->maxConnections < 1)
+					error("Connection limit must be at least 1.", 0);
+				break;
+			case 'i': // bytes each event loop may hold for requests in flight
+				config->maxInFlight = strtoull(optarg, NULL, 10);
+				if(config->maxInFlight < 1)
+					error("In-flight limit must be at least 1 byte.", 0);
+				break;
+			case 'q': // listen backlog
+				config->backlog = atoi(optarg);
+				if(config->backlog < 1)
+					error("Backlog must be at least 1.", 0);
+				break;
+			case 't': // idle, read and write deadlines in seconds
+				parseTimeouts(optarg, config);
+				break;
+			default:
+				fprintf(stderr,"USAGE: %s [-w workers] [-s] [-b epoll|io_uring] [-m max-bytes] [-p pad-directory] [-c max-connections] [-i max-in-flight-bytes] [-q backlog] [-t idle[,read[,write]]] [-a admin-port | unix:path] port|unix:path\n", argv[0]);
+				exit(1);
+		}
+	}
+
+	// sharded without -w: one worker for every CPU this process may use
+	if(config->shards && config->workers == 0)
+	{
+		cpu_set_t allowed;
+		config->workers = allowedCpus(&allowed);
+	}
+
+	// verify port was provided and print usage if not
+	if (optind >= argc) { fprintf(stderr,"USAGE: %s [-w workers] [-s] [-b epoll|io_uring] [-m max-bytes] [-p pad-directory] [-c max-connections] [-i max-in-flight-bytes] [-q backlog] [-t idle[,read[,write]]] [-a admin-port | unix:path] port|unix:path\n", argv[0]); exit(1); } // Check usage & args
+	// unix:<path> listens on a UNIX socket, for clients on this host
+	if(strncmp(argv[optind], "unix:", 5) == 0)
+		config->unixPath = argv[optind] + 5;
+	else
+		config->port = atoi(argv[optind]); // Get the port number, convert to an integer from a string
+}
+
+int otpServe(const struct otpService* service, const struct otpServerConfig* config)
+{
+	// Create and initialize handler for SIGINT (and SIGTERM, which stops pool workers)
+	// no SA_RESTART: epoll_wait() / waitpid() must return EINTR to notice it
+	SIGINT_action.sa_handler = catchSIGINT;
+	sigfillset(&SIGINT_action.sa_mask);
+	SIGINT_action.sa_flags = 0;
+	sigaction(SIGINT, &SIGINT_action, NULL); // catch and redirect to function
+	sigaction(SIGTERM, &SIGINT_action, NULL);
+
+	// one listen socket every worker accepts from, or with -s one per
+	// worker in a SO_REUSEPORT group, which the kernel spreads clients over.
+	// The parent holds them all, so clients queued on a shard whose worker
+	// died wait for its replacement instead of being dropped. A UNIX socket
+	// has no SO_REUSEPORT group, so shards share its one listener
+	int listeners = (config->shards && config->unixPath == NULL) ? config->workers : 1;
+	int* listenSocketFDs = malloc(listeners * sizeof(int));
+	if(listenSocketFDs == NULL)
+		error("Unable to allocate listen sockets.", 0);
+	int i;
+	if(config->unixPath != NULL)
+	{
+		listenSocketFDs[0] = openUnixSocket(config->unixPath);
+		fcntl(listenSocketFDs[0], F_SETFL, O_NONBLOCK);
+		listen(listenSocketFDs[0], config->backlog);
+	}
+	else
+	{
+		for(i = 0; i < listeners; i++)
+			listenSocketFDs[i] = openListenSocket(config->port, config->shards, config->backlog);
+	}
+
+	// with -a, every worker counts into its own slot of a shared mapping
+	// and a separate process answers scrapes from it, off the request path
+	struct otpMetrics* metrics = NULL;
+	int slots = (config->workers > 0) ? config->workers : 1;
+	if(config->admin != NULL)
+	{
+		metrics = otpMetricsCreate(slots);
+		if(metrics == NULL)
+			error("ERROR mapping metrics",1);
+		adminSocketFD = openAdminSocket(config->admin);
+	}
+
+	// one event loop here, or one in each of the pool's workers
+	if(config->workers == 0)
+	{
+		pid_t admin = (metrics != NULL) ? spawnAdmin(service, metrics, slots, listenSocketFDs, listeners) : 0;
+		runWorker(service, config, metrics, listenSocketFDs[0]);
+		if(admin > 0)
+		{
+			kill(admin, SIGTERM);
+			waitpid(admin, NULL, 0);
+		}
+	}
+	else
+		servePool(service, config, metrics, listenSocketFDs, listeners);
+
+	// close the listening sockets
+	for(i = 0; i < listeners; i++)
+		close(listenSocketFDs[i]);
+	free(listenSocketFDs);
+	if(config->unixPath != NULL)
+		unlink(config->unixPath);
+	if(adminSocketFD >= 0)
+	{
+		close(adminSocketFD);
+		if(strncmp(config->admin, "unix:", 5) == 0)
+			unlink(config->admin + 5);
+	}
+	return 0;
+}
+
+// Sets the deadlines from a list of up to three comma separated seconds,
+// idle[,read[,write]]; those left out keep their defaults, 0 turns one off
+static void parseTimeouts(const char* list, struct otpServerConfig* config)
+{
+	unsigned int* timeouts[] = { &config->idleTimeout, &config->readTimeout, &config->writeTimeout };
+	const char* at = list;
+	int i;
+
+	for(i = 0; i < 3; i++)
+	{
+		char* end;
+		double seconds = strtod(at, &end);
+		if(end == at || seconds < 0 || seconds * 1000 > UINT_MAX || (*end != ',' && *end != '\0'))
+			error("Deadlines must be idle[,read[,write]] in seconds.", 0);
+		*timeouts[i] = (unsigned int)(seconds * 1000);
+		if(*end == '\0')
+			return;
+		at = end + 1;
+	}
+	error("Deadlines must be idle[,read[,write]] in seconds.", 0);
+}
+
+// Creates, binds and starts listening on the non blocking server socket
+// Accepts the port, whether to join the port's SO_REUSEPORT group and
+// how many connections may wait to be accepted
+static int openListenSocket(int portNumber, int reusePort, int backlog)
+{
+	struct sockaddr_in serverAddress;
+
+	// Set up the address struct for this process (the server)
+	memset((char *)&serverAddress, '\0', sizeof(serverAddress)); // Clear out the address struct
+	serverAddress.sin_family = AF_INET; // Create a network-capable socket
+	serverAddress.sin_port = htons(portNumber); // Store the port number
+	serverAddress.sin_addr.s_addr = INADDR_ANY; // Any address is allowed for connection to this process
+
+	// Set up the socket
+	int listenSocketFD = socket(AF_INET, SOCK_STREAM, 0); // Create the socket
+	if (listenSocketFD < 0)
+		error("ERROR opening socket",1);
+
+	// set to non blocking, the event loop accepts until EAGAIN
+	fcntl(listenSocketFD,F_SETFL, O_NONBLOCK);
+
+	if(reusePort && setsockopt(listenSocketFD, SOL_SOCKET, SO_REUSEPORT, &reusePort, sizeof(reusePort)) < 0)
+		error("ERROR setting SO_REUSEPORT",1);
+
+	// Enable the socket to begin listening
+	if (bind(listenSocketFD, (struct sockaddr *)&serverAddress, sizeof(serverAddress)) < 0) // Connect socket to port
+		error("ERROR on binding",1);
+	listen(listenSocketFD, backlog); // Flip the socket on - a short queue drops bursts of connects, which then wait a second to retry
+
+	return listenSocketFD;
+}
+
+// Creates and binds a UNIX stream socket at path, replacing a socket an
+// earlier run left there; the caller starts it listening
+static int openUnixSocket(const char* path)
+{
+	struct sockaddr_un unixAddress;
+	memset(&unixAddress, 0, sizeof(unixAddress));
+	unixAddress.sun_family = AF_UNIX;
+	if(strlen(path) >= sizeof(unixAddress.sun_path))
+		error("Socket path is too long.", 0);
+	strcpy(unixAddress.sun_path, path);
+
+	// a socket left behind by an earlier run would block the bind
+	struct stat existing;
+	if(stat(unixAddress.sun_path, &existing) == 0 && S_ISSOCK(existing.st_mode))
+		unlink(unixAddress.sun_path);
+
+	int socketFD = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(socketFD < 0)
+		error("ERROR opening UNIX socket",1);
+	if(bind(socketFD, (struct sockaddr*)&unixAddress, sizeof(unixAddress)) < 0)
+		error("ERROR binding UNIX socket",1);
+	return socketFD;
+}
+
+// Opens the metrics endpoint: unix:<path> for a UNIX socket, otherwise a
+// port that only accepts connections from this host
+static int openAdminSocket(const char* address)
+{
+	int adminFD;
+
+	if(strncmp(address, "unix:", 5) == 0)
+		adminFD = openUnixSocket(address + 5);
+	else
+	{
+		struct sockaddr_in loopbackAddress;
+		memset(&loopbackAddress, 0, sizeof(loopbackAddress));
+		loopbackAddress.sin_family = AF_INET;
+		loopbackAddress.sin_port = htons(atoi(address));
+		loopbackAddress.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		adminFD = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if(adminFD < 0)
+			error("ERROR opening admin socket",1);
+		if(bind(adminFD, (struct sockaddr*)&loopbackAddress, sizeof(loopbackAddress)) < 0)
+			error("ERROR binding admin socket",1);
+	}
+
+	listen(adminFD, 16);
+	return adminFD;
+}
+
+// Pool model: start a fixed number of workers that each run their own
+// event loop on the shared listen socket. The parent only restarts
+// workers (and the admin process) that die.
+static void servePool(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	const int* listenSocketFDs, int listeners)
+{
+	int workers = config->workers;
+	pid_t* pids = calloc(workers, sizeof(pid_t));
+	int i;
+
+	// start all workers up front, each with its own metrics slot (and shard)
+	for(i = 0; i < workers; i++)
+		pids[i] = spawnWorker(service, config, (metrics != NULL) ? &metrics[i] : NULL,
+			listenSocketFDs[i % listeners], config->shards ? i : -1);
+	pid_t admin = (metrics != NULL) ? spawnAdmin(service, metrics, workers, listenSocketFDs, listeners) : 0;
+
+	// while sigint is not received, replace any worker that exits
+	while(keepListening)
+	{
+		int childExitMethod = -5;
+		pid_t finished_child = waitpid(-1, &childExitMethod, 0);
+
+		// interrupted by SIGINT (or nothing left to wait on)
+		if(finished_child < 0)
+			continue;
+
+		if(WIFSIGNALED(childExitMethod) != 0)
+		{
+			fprintf(stderr,"\nWorker PID %d terminated. Signal: %d\n",finished_child, WTERMSIG(childExitMethod));
+			fflush(stderr);
+		}
+
+		if(finished_child == admin)
+		{
+			admin = keepListening ? spawnAdmin(service, metrics, workers, listenSocketFDs, listeners) : 0;
+			continue;
+		}
+
+		// find its slot and start a replacement, which keeps the slot's
+		// totals but none of the dead worker's connections
+		for(i = 0; i < workers; i++)
+		{
+			if(pids[i] == finished_child)
+			{
+				if(metrics != NULL)
+					otpMetricSub(&metrics[i].active, metrics[i].active);
+				pids[i] = keepListening ? spawnWorker(service, config, (metrics != NULL) ? &metrics[i] : NULL,
+					listenSocketFDs[i % listeners], config->shards ? i : -1) : 0;
+				break;
+			}
+		}
+	}
+
+	// shut the pool down
+	for(i = 0; i < workers; i++)
+	{
+		if(pids[i] > 0)
+			kill(pids[i], SIGTERM);
+	}
+	if(admin > 0)
+		kill(admin, SIGTERM);
+	while(waitpid(-1, NULL, 0) > 0)
+		;
+
+	free(pids);
+}
+
+// Forks one pool worker (shard is -1 unless sharded), returns its pid in the parent
+static pid_t spawnWorker(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	int listenSocketFD, int shard)
+{
+	pid_t spawn = fork();
+	if(spawn < 0)
+		error("ERROR spawning worker process",1);
+
+	if(spawn == 0)
+	{
+		if(adminSocketFD >= 0)
+			close(adminSocketFD);
+		// pinned before the event loop allocates anything, so first touch
+		// places its buffers on this CPU's NUMA node
+		if(shard >= 0)
+			pinToCpu(shard);
+		runWorker(service, config, metrics, listenSocketFD);
+		exit(0);
+	}
+	return spawn;
+}
+
+// Forks the process that answers metrics scrapes, returns its pid in the parent
+static pid_t spawnAdmin(const struct otpService* service, struct otpMetrics* metrics, int slots, const int* listenSocketFDs, int listeners)
+{
+	pid_t spawn = fork();
+	if(spawn < 0)
+		error("ERROR spawning admin process",1);
+
+	if(spawn == 0)
+	{
+		int i;
+		for(i = 0; i < listeners; i++)
+			close(listenSocketFDs[i]);
+		otpMetricsServe(adminSocketFD, metrics, slots, service->name, &keepListening);
+		exit(0);
+	}
+	return spawn;
+}
+
+// Serves from one event loop on the chosen backend, falling back to epoll
+// if io_uring was asked for and the kernel cannot provide it
+static void runWorker(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics, int listenSocketFD)
+{
+	if(config->uring)
+	{
+		if(otpRunUring(service, config, metrics, listenSocketFD, &keepListening) == 0)
+			return;
+		fprintf(stderr,"%s: io_uring is not available, using epoll.\n", service->name);
+	}
+	otpRunReactor(service, config, metrics, listenSocketFD, &keepListening);
+}
+
+// Fills allowed with the CPUs this process may run on, returns how many
+static int allowedCpus(cpu_set_t* allowed)
+{
+	if(sched_getaffinity(0, sizeof(*allowed), allowed) < 0)
+	{
+		CPU_ZERO(allowed);
+		CPU_SET(0, allowed);
+	}
+	return CPU_COUNT(allowed);
+}
+
+// Pins the calling worker to one of the allowed CPUs, shard by shard
+static void pinToCpu(int shard)
+{
+	cpu_set_t allowed, pinned;
+	int skip = shard % allowedCpus(&allowed);
+	int cpu;
+
+	for(cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if(CPU_ISSET(cpu, &allowed) && skip-- == 0)
+			break;
+	}
+	CPU_ZERO(&pinned);
+	CPU_SET(cpu, &pinned);
+	if(sched_setaffinity(0, sizeof(pinned), &pinned) < 0)
+		perror("sched_setaffinity");
+}
+
+/****************************************
+ *				catchSIGINT			*
+ *										*
+ * Stops the event loop / pool.		*
+ * *************************************/
+static void catchSIGINT(int signo)
+{
+	keepListening = 0;
+}
+
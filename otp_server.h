@@ -0,0 +1,58 @@
+#ifndef OTP_SERVER_H
+#define OTP_SERVER_H
+
+#include <stddef.h>
+#include "otp_pad.h"
+
+// Daemon loop shared by otp_enc_d and otp_dec_d (libotp).
+// Each daemon only describes what it serves; accepting, handshaking,
+// receiving packages and sending the result back all live here.
+
+// what a daemon serves; services chained through next share one port,
+// pool and set of metrics, and the client's handshake id picks between them
+struct otpService
+{
+	const char* name;		// program name, for messages
+	int handshakeId;		// id a client must send to be accepted
+	// writes len transformed symbols of text/key into out
+	void (*transform)(char* out, const char* text, const char* key, size_t len);
+	const struct otpService* next;	// another service on the same port, or NULL
+};
+
+// deadlines used unless -t says otherwise, in milliseconds
+#define OTP_IDLE_TIMEOUT 60000
+#define OTP_READ_TIMEOUT 30000
+#define OTP_WRITE_TIMEOUT 30000
+
+// options taken from the command line
+struct otpServerConfig
+{
+	int port;				// TCP port to listen on
+	const char* unixPath;	// UNIX socket to listen on instead (unix:<path>), NULL for TCP
+	int workers;			// worker processes, 0 serves from this process
+	int shards;				// each worker has its own SO_REUSEPORT listener and CPU
+	int uring;				// serve with io_uring where the kernel has it, else epoll
+	size_t packageLimit;	// largest whole text or key a client may send, in bytes
+	struct otpPadStore pads;	// pads clients may name instead of sending a key
+	const char* admin;		// metrics endpoint (port or unix:<path>), NULL for none
+
+	// admission control, per event loop (0 for no limit): past either
+	// limit new clients are turned away as busy instead of queueing work
+	int maxConnections;		// clients served at once
+	size_t maxInFlight;		// bytes of requests received and answers not yet sent
+	int backlog;			// connections the kernel queues until a worker accepts them
+
+	// deadlines in milliseconds (0 for none), each restarted whenever the
+	// connection makes progress; a connection that misses one is closed
+	unsigned int idleTimeout;	// between requests
+	unsigned int readTimeout;	// while a handshake or request is arriving
+	unsigned int writeTimeout;	// while output waits to be sent
+};
+
+// fills config from argv, printing usage and exiting on bad arguments
+void otpServerParseArgs(int argc, char* argv[], struct otpServerConfig* config);
+
+// listens and serves until SIGINT, returns the exit status
+int otpServe(const struct otpService* service, const struct otpServerConfig* config);
+
+#endif
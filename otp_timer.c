@@ -0,0 +1,179 @@
+#include <limits.h>
+#include "otp_timer.h"
+
+#define OTP_TIMER_MASK (OTP_TIMER_SLOTS - 1)
+
+// forward declarations
+static void file(struct otpTimerWheel* wheel, struct otpTimer* timer);
+static void detach(struct otpTimerWheel* wheel, struct otpTimer* timer);
+static void cascade(struct otpTimerWheel* wheel);
+static uint64_t nextTick(const struct otpTimerWheel* wheel);
+
+void otpTimerWheelInit(struct otpTimerWheel* wheel, uint64_t now)
+{
+	int level, slot;
+
+	wheel->now = now;
+	for(level = 0; level < OTP_TIMER_LEVELS; level++)
+	{
+		wheel->occupied[level] = 0;
+		for(slot = 0; slot < OTP_TIMER_SLOTS; slot++)
+			wheel->slots[level][slot].prev = wheel->slots[level][slot].next = &wheel->slots[level][slot];
+	}
+}
+
+void otpTimerSchedule(struct otpTimerWheel* wheel, struct otpTimer* timer, uint64_t expires)
+{
+	// connections push their deadline on every event, mostly to where it already is
+	if(timer->next != NULL)
+	{
+		if(timer->expires == expires)
+			return;
+		detach(wheel, timer);
+	}
+	timer->expires = expires;
+	file(wheel, timer);
+}
+
+void otpTimerCancel(struct otpTimerWheel* wheel, struct otpTimer* timer)
+{
+	if(timer->next != NULL)
+		detach(wheel, timer);
+}
+
+struct otpTimer* otpTimerExpire(struct otpTimerWheel* wheel, uint64_t now)
+{
+	while(1)
+	{
+		// the current level 0 slot holds exactly the timers due now
+		struct otpTimer* head = &wheel->slots[0][wheel->now & OTP_TIMER_MASK];
+		if(head->next != head)
+		{
+			struct otpTimer* due = head->next;
+			detach(wheel, due);
+			return due;
+		}
+
+		// skip straight to the next tick with a slot to fire or refile
+		uint64_t next = nextTick(wheel);
+		if(next > now)
+		{
+			if(now > wheel->now)
+				wheel->now = now;
+			return NULL;
+		}
+		wheel->now = next;
+		cascade(wheel);
+	}
+}
+
+int otpTimerTimeout(const struct otpTimerWheel* wheel, uint64_t now)
+{
+	const struct otpTimer* head = &wheel->slots[0][wheel->now & OTP_TIMER_MASK];
+	if(head->next != head)
+		return 0;
+
+	uint64_t next = nextTick(wheel);
+	if(next == UINT64_MAX)
+		return -1;
+	if(next <= now)
+		return 0;
+	return (next - now > INT_MAX) ? INT_MAX : (int)(next - now);
+}
+
+// Links timer into the slot its expiry falls in: the lowest level where
+// it shares every higher bit with the current tick. A timer already due
+// goes in the current level 0 slot, one past the top level's reach waits
+// in the top slot the wheel comes to last and is refiled from there
+static void file(struct otpTimerWheel* wheel, struct otpTimer* timer)
+{
+	uint64_t expires = timer->expires;
+	int level = 0;
+	unsigned slot;
+
+	if(expires <= wheel->now)
+		slot = wheel->now & OTP_TIMER_MASK;
+	else
+	{
+		while(level < OTP_TIMER_LEVELS - 1
+			&& (expires >> ((level + 1) * OTP_TIMER_BITS)) != (wheel->now >> ((level + 1) * OTP_TIMER_BITS)))
+			level++;
+
+		int shift = level * OTP_TIMER_BITS;
+		if(level == OTP_TIMER_LEVELS - 1 && expires - wheel->now >= (uint64_t)1 << (OTP_TIMER_LEVELS * OTP_TIMER_BITS))
+			slot = ((wheel->now >> shift) + OTP_TIMER_MASK) & OTP_TIMER_MASK;
+		else
+			slot = (expires >> shift) & OTP_TIMER_MASK;
+	}
+
+	struct otpTimer* head = &wheel->slots[level][slot];
+	timer->level = (unsigned char)level;
+	timer->slot = (unsigned char)slot;
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+	wheel->occupied[level] |= (uint64_t)1 << slot;
+}
+
+// Unlinks timer from its slot, leaving it unscheduled
+static void detach(struct otpTimerWheel* wheel, struct otpTimer* timer)
+{
+	struct otpTimer* head = &wheel->slots[timer->level][timer->slot];
+
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->prev = timer->next = NULL;
+	if(head->next == head)
+		wheel->occupied[timer->level] &= ~((uint64_t)1 << timer->slot);
+}
+
+// On reaching a tick that starts a slot of a higher level, refiles that
+// slot's timers, which now all fall in lower levels. Highest first, so
+// timers refiled into a slot starting at the same tick move on down too
+static void cascade(struct otpTimerWheel* wheel)
+{
+	int level;
+	for(level = OTP_TIMER_LEVELS - 1; level > 0; level--)
+	{
+		int shift = level * OTP_TIMER_BITS;
+		if(wheel->now & (((uint64_t)1 << shift) - 1))
+			continue;
+
+		struct otpTimer* head = &wheel->slots[level][(wheel->now >> shift) & OTP_TIMER_MASK];
+		while(head->next != head)
+		{
+			struct otpTimer* timer = head->next;
+			detach(wheel, timer);
+			file(wheel, timer);
+		}
+	}
+}
+
+// The first tick after the current one that fires or refiles a slot,
+// UINT64_MAX if the wheel is empty. Occupied slots of a level lie ahead
+// of its current slot within the current turn of the level above, except
+// in the top level, which may hold timers for its next turn
+static uint64_t nextTick(const struct otpTimerWheel* wheel)
+{
+	uint64_t next = UINT64_MAX;
+	int level;
+
+	for(level = 0; level < OTP_TIMER_LEVELS; level++)
+	{
+		uint64_t occupied = wheel->occupied[level];
+		if(occupied == 0)
+			continue;
+
+		int shift = level * OTP_TIMER_BITS;
+		unsigned current = (wheel->now >> shift) & OTP_TIMER_MASK;
+		uint64_t ahead = (current == OTP_TIMER_MASK) ? 0 : occupied & (~(uint64_t)0 << (current + 1));
+		uint64_t turn = (wheel->now >> (shift + OTP_TIMER_BITS)) << (shift + OTP_TIMER_BITS);
+		uint64_t tick = (ahead != 0)
+			? turn + ((uint64_t)__builtin_ctzll(ahead) << shift)
+			: turn + ((uint64_t)(OTP_TIMER_SLOTS + __builtin_ctzll(occupied)) << shift);
+		if(tick < next)
+			next = tick;
+	}
+	return next;
+}
@@ -0,0 +1,63 @@
+#ifndef OTP_TIMER_H
+#define OTP_TIMER_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Hierarchical timer wheel (libotp), one per event loop, for connection
+// deadlines. Time is counted in millisecond ticks. Level 0 has a slot for
+// each of the next 64 ticks, and each level above covers 64 times as much
+// time per slot. A timer is filed in the lowest level whose range holds
+// its expiry. When the wheel reaches a higher slot, that slot's timers are
+// refiled one level down. Scheduling, rescheduling and cancelling are O(1)
+// whatever the number of timers, and so is finding the next tick that
+// has work, through a bitmap of occupied slots per level.
+
+#define OTP_TIMER_BITS 6
+#define OTP_TIMER_SLOTS (1 << OTP_TIMER_BITS)
+#define OTP_TIMER_LEVELS 4		// 2^24 ms, about 4.6 hours; later expiries wait in the top level
+
+// embedded in whatever it times; next is NULL while it is not scheduled
+struct otpTimer
+{
+	struct otpTimer* prev;
+	struct otpTimer* next;
+	uint64_t expires;		// tick it is due at
+	unsigned char level;
+	unsigned char slot;
+};
+
+struct otpTimerWheel
+{
+	uint64_t now;			// every timer due at or before this tick has been handed out
+	uint64_t occupied[OTP_TIMER_LEVELS];
+	struct otpTimer slots[OTP_TIMER_LEVELS][OTP_TIMER_SLOTS];	// list heads
+};
+
+// the wheel's clock: monotonic milliseconds, from the cheap coarse clock
+static inline uint64_t otpTimerNow()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Empties the wheel, starting it at tick now
+void otpTimerWheelInit(struct otpTimerWheel* wheel, uint64_t now);
+
+// (Re)schedules timer for tick expires; one already due fires on the next
+// otpTimerExpire
+void otpTimerSchedule(struct otpTimerWheel* wheel, struct otpTimer* timer, uint64_t expires);
+
+// Unschedules timer if it is scheduled
+void otpTimerCancel(struct otpTimerWheel* wheel, struct otpTimer* timer);
+
+// Moves the wheel up to tick now and returns one timer due by then,
+// unscheduled, or NULL once there are none left
+struct otpTimer* otpTimerExpire(struct otpTimerWheel* wheel, uint64_t now);
+
+// Milliseconds from now until the wheel next has work, for epoll_wait():
+// 0 if a timer is due already, -1 if there are no timers
+int otpTimerTimeout(const struct otpTimerWheel* wheel, uint64_t now);
+
+#endif
@@ -0,0 +1,541 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/io_uring.h>
+#include "otp_conn.h"
+
+// io_uring backend: accept, recv and send are submitted to the kernel and
+// completed in batches, one io_uring_enter() call submitting everything
+// queued since the last one and collecting whatever has finished. Drives
+// the same connection state machine as the epoll reactor, and one multishot
+// accept serves the listen socket. Each connection has one operation in
+// flight at a time, a send of its pending output or a recv straight into
+// its window: output must stay where it is until the kernel has sent it,
+// and what a recv feeds in may append to (and move) it.
+
+// submission queue entries; completions get twice as many
+#define OTP_URING_ENTRIES 1024
+
+// closed connections kept with their buffers for the next client
+#define OTP_URING_SPARE 64
+
+// what a completion was for, kept in the low bits of its user_data
+// (the rest is the connection, NULL for accept)
+#define OTP_OP_ACCEPT 0
+#define OTP_OP_RECV 1
+#define OTP_OP_SEND 2
+#define OTP_OP_MASK 3
+
+// conn->events while on this backend: operations in flight, and closing
+#define OTP_IN_RECV 1
+#define OTP_IN_SEND 2
+#define OTP_CLOSING 4
+
+// one ring, owned by a single worker
+struct otpUring
+{
+	int ringFD;
+	int listenSocketFD;
+	const struct otpService* service;
+	const struct otpServerConfig* config;
+	struct otpMetrics* metrics;
+	int multishotAccept;		// cleared if the kernel turns it down
+
+	// submission queue
+	unsigned* sqHead;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned sqEntries;
+	unsigned sqLocalTail;		// where the next entry goes
+	unsigned toSubmit;
+	struct io_uring_sqe* sqes;
+
+	// completion queue
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	struct io_uring_cqe* cqes;
+
+	void* ringMap;
+	size_t ringMapSize;
+	size_t sqesMapSize;
+
+	struct otpConnection* open;
+	struct otpConnection* spare;
+	int spareCount;
+	struct otpLoad load;
+	struct otpTimerWheel timers;	// every open connection's deadline
+	uint64_t now;
+};
+
+// forward declarations
+static int setupRing(struct otpUring* ring);
+static int probeOps(struct otpUring* ring);
+static void closeRing(struct otpUring* ring);
+static struct io_uring_sqe* nextEntry(struct otpUring* ring);
+static int submitAndWait(struct otpUring* ring, int timeout);
+static void armAccept(struct otpUring* ring);
+static void accepted(struct otpUring* ring, int fd);
+static void completeRecv(struct otpUring* ring, struct otpConnection* conn, int result);
+static void completeSend(struct otpUring* ring, struct otpConnection* conn, int result);
+static void advance(struct otpUring* ring, struct otpConnection* conn);
+static void beginClose(struct otpUring* ring, struct otpConnection* conn);
+static void finishClose(struct otpUring* ring, struct otpConnection* conn);
+static void armDeadline(struct otpUring* ring, struct otpConnection* conn);
+static void expireConnections(struct otpUring* ring);
+
+int otpRunUring(const struct otpService* service, const struct otpServerConfig* config, struct otpMetrics* metrics,
+	int listenSocketFD, volatile sig_atomic_t* keepRunning)
+{
+	struct otpUring ring;
+
+	memset(&ring, 0, sizeof(ring));
+	ring.listenSocketFD = listenSocketFD;
+	ring.service = service;
+	ring.config = config;
+	ring.metrics = metrics;
+	ring.multishotAccept = 1;
+	ring.now = otpTimerNow();
+	otpTimerWheelInit(&ring.timers, ring.now);
+
+	// no io_uring here (old kernel, or disabled by policy): let the caller fall back
+	if(setupRing(&ring) < 0)
+		return -1;
+	if(!probeOps(&ring))
+	{
+		closeRing(&ring);
+		return -1;
+	}
+
+	armAccept(&ring);
+	while(*keepRunning)
+	{
+		int waited = submitAndWait(&ring, otpTimerTimeout(&ring.timers, ring.now));
+		ring.now = otpTimerNow();
+		if(waited < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			perror("io_uring_enter");
+			break;
+		}
+
+		// everything that has completed; the head is only published once
+		// the batch is done, as completions may queue new submissions
+		unsigned head = *ring.cqHead;
+		unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++)
+		{
+			struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cqMask];
+			uint64_t data = cqe->user_data;
+			struct otpConnection* conn = (struct otpConnection*)(uintptr_t)(data & ~(uint64_t)OTP_OP_MASK);
+
+			switch(data & OTP_OP_MASK)
+			{
+				case OTP_OP_ACCEPT:
+					if(cqe->res >= 0)
+						accepted(&ring, cqe->res);
+					else if(cqe->res == -EINVAL && ring.multishotAccept)
+						ring.multishotAccept = 0;	// older kernel, accept one at a time
+					else if(cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED)
+					{
+						errno = -cqe->res;
+						perror("Error on accept");
+					}
+					// a multishot accept stays armed until told otherwise
+					if(!(cqe->flags & IORING_CQE_F_MORE))
+						armAccept(&ring);
+					break;
+
+				case OTP_OP_RECV:
+					completeRecv(&ring, conn, cqe->res);
+					break;
+
+				case OTP_OP_SEND:
+					completeSend(&ring, conn, cqe->res);
+					break;
+			}
+		}
+		__atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+
+		expireConnections(&ring);
+	}
+
+	// drop whatever is still open; closing the ring cancels its operations
+	closeRing(&ring);
+	while(ring.open != NULL)
+	{
+		struct otpConnection* conn = ring.open;
+		ring.open = conn->next;
+		close(conn->fd);
+		otpConnFree(conn);
+		free(conn);
+	}
+	while(ring.spare != NULL)
+	{
+		struct otpConnection* conn = ring.spare;
+		ring.spare = conn->next;
+		otpConnFree(conn);
+		free(conn);
+	}
+	return 0;
+}
+
+// Creates the ring and maps its queues. Returns -1 if io_uring is unavailable
+static int setupRing(struct otpUring* ring)
+{
+	// newest flags first: one issuer with task work deferred to
+	// io_uring_enter() avoids interrupting the worker for completions
+	static const unsigned flagSets[] =
+	{
+		IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN,
+		IORING_SETUP_COOP_TASKRUN,
+		0
+	};
+	struct io_uring_params params;
+	size_t f;
+
+	ring->ringFD = -1;
+	for(f = 0; f < sizeof(flagSets) / sizeof(flagSets[0]) && ring->ringFD < 0; f++)
+	{
+		memset(&params, 0, sizeof(params));
+		params.flags = flagSets[f];
+		ring->ringFD = syscall(__NR_io_uring_setup, OTP_URING_ENTRIES, &params);
+		if(ring->ringFD < 0 && errno != EINVAL)
+			return -1;
+	}
+	if(ring->ringFD < 0)
+		return -1;
+
+	// kernels old enough to map the two rings separately, or to lack a
+	// timeout on the wait for completions (deadlines need one), are not worth supporting
+	if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG))
+	{
+		close(ring->ringFD);
+		return -1;
+	}
+
+	size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring->ringMapSize = (sqSize > cqSize) ? sqSize : cqSize;
+	ring->ringMap = mmap(NULL, ring->ringMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFD, IORING_OFF_SQ_RING);
+	if(ring->ringMap == MAP_FAILED)
+	{
+		close(ring->ringFD);
+		return -1;
+	}
+	ring->sqesMapSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqesMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringFD, IORING_OFF_SQES);
+	if(ring->sqes == MAP_FAILED)
+	{
+		munmap(ring->ringMap, ring->ringMapSize);
+		close(ring->ringFD);
+		return -1;
+	}
+
+	char* base = ring->ringMap;
+	ring->sqHead = (unsigned*)(base + params.sq_off.head);
+	ring->sqTail = (unsigned*)(base + params.sq_off.tail);
+	ring->sqMask = (unsigned*)(base + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned*)(base + params.sq_off.array);
+	ring->sqEntries = params.sq_entries;
+	ring->sqLocalTail = *ring->sqTail;
+	ring->cqHead = (unsigned*)(base + params.cq_off.head);
+	ring->cqTail = (unsigned*)(base + params.cq_off.tail);
+	ring->cqMask = (unsigned*)(base + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe*)(base + params.cq_off.cqes);
+	return 0;
+}
+
+// Checks the kernel knows every operation this backend submits
+// returns 0 if one is missing
+static int probeOps(struct otpUring* ring)
+{
+	static const int needed[] = { IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND };
+	size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+	struct io_uring_probe* probe = calloc(1, size);
+	if(probe == NULL)
+		return 0;
+
+	int supported = (syscall(__NR_io_uring_register, ring->ringFD, IORING_REGISTER_PROBE, probe, 256) == 0);
+	size_t i;
+	for(i = 0; supported && i < sizeof(needed) / sizeof(needed[0]); i++)
+	{
+		if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED))
+			supported = 0;
+	}
+	free(probe);
+	return supported;
+}
+
+static void closeRing(struct otpUring* ring)
+{
+	munmap(ring->sqes, ring->sqesMapSize);
+	munmap(ring->ringMap, ring->ringMapSize);
+	close(ring->ringFD);
+}
+
+// Returns a cleared submission entry, submitting what is queued first if the queue is full
+static struct io_uring_sqe* nextEntry(struct otpUring* ring)
+{
+	while(ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+	{
+		if(syscall(__NR_io_uring_enter, ring->ringFD, ring->toSubmit, 0, 0, NULL, 0) >= 0)
+			ring->toSubmit = 0;
+		else if(errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		{
+			perror("io_uring_enter");
+			exit(1);
+		}
+	}
+
+	unsigned index = ring->sqLocalTail & *ring->sqMask;
+	struct io_uring_sqe* sqe = &ring->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring->sqArray[index] = index;
+	ring->sqLocalTail++;
+	ring->toSubmit++;
+
+	// published right away; the kernel only looks once io_uring_enter() is called
+	__atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+// Submits everything queued and waits for at least one completion, or
+// for timeout milliseconds to pass (-1 waits as long as it takes)
+static int submitAndWait(struct otpUring* ring, int timeout)
+{
+	struct __kernel_timespec limit;
+	struct io_uring_getevents_arg wait;
+	memset(&wait, 0, sizeof(wait));
+	if(timeout >= 0)
+	{
+		limit.tv_sec = timeout / 1000;
+		limit.tv_nsec = (timeout % 1000) * 1000000LL;
+		wait.ts = (uintptr_t)&limit;
+	}
+
+	int submitted = syscall(__NR_io_uring_enter, ring->ringFD, ring->toSubmit, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+		&wait, sizeof(wait));
+	if(submitted < 0)
+		return (errno == ETIME) ? 0 : -1;
+	ring->toSubmit -= (unsigned)submitted;
+	return 0;
+}
+
+static void armAccept(struct otpUring* ring)
+{
+	struct io_uring_sqe* sqe = nextEntry(ring);
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ring->listenSocketFD;
+	sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+	if(ring->multishotAccept)
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = OTP_OP_ACCEPT;
+}
+
+// Takes on a client the kernel accepted
+static void accepted(struct otpUring* ring, int fd)
+{
+	// see acceptClients() in the epoll reactor
+	int noDelay = 1;
+	if(ring->config->unixPath == NULL)
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+	struct otpConnection* conn = ring->spare;
+	if(conn != NULL)
+	{
+		ring->spare = conn->next;
+		ring->spareCount--;
+	}
+	else
+	{
+		conn = calloc(1, sizeof(struct otpConnection));
+		if(conn == NULL)
+		{
+			close(fd);
+			return;
+		}
+	}
+	otpConnReset(conn, ring->service, ring->config, ring->metrics, fd);
+	otpConnAdmit(conn, &ring->load);
+	if(ring->metrics != NULL)
+	{
+		otpMetricAdd(&ring->metrics->accepted, 1);
+		otpMetricAdd(&ring->metrics->active, 1);
+	}
+
+	conn->prev = NULL;
+	conn->next = ring->open;
+	if(ring->open != NULL)
+		ring->open->prev = conn;
+	ring->open = conn;
+
+	advance(ring, conn);
+}
+
+static void completeRecv(struct otpUring* ring, struct otpConnection* conn, int result)
+{
+	conn->events &= ~OTP_IN_RECV;
+	if(conn->events & OTP_CLOSING)
+	{
+		finishClose(ring, conn);
+		return;
+	}
+
+	// client hung up or the socket failed, or the data broke the protocol
+	if(result <= 0 || !otpConnFeed(conn, conn->window, result))
+	{
+		beginClose(ring, conn);
+		return;
+	}
+	advance(ring, conn);
+}
+
+static void completeSend(struct otpUring* ring, struct otpConnection* conn, int result)
+{
+	conn->events &= ~OTP_IN_SEND;
+	if(conn->events & OTP_CLOSING)
+	{
+		finishClose(ring, conn);
+		return;
+	}
+
+	if(result < 0)
+	{
+		beginClose(ring, conn);
+		return;
+	}
+	otpConnSent(conn, result);
+	advance(ring, conn);
+}
+
+// Queues whatever the connection is ready for: a send of pending output,
+// else a recv into its window, or its close once it is done
+static void advance(struct otpUring* ring, struct otpConnection* conn)
+{
+	if(otpConnFinished(conn))
+	{
+		beginClose(ring, conn);
+		return;
+	}
+	if(conn->events & (OTP_IN_RECV | OTP_IN_SEND))
+		return;
+
+	const char* pending;
+	size_t length = otpConnPending(conn, &pending);
+	if(length > 0)
+	{
+		struct io_uring_sqe* sqe = nextEntry(ring);
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = conn->fd;
+		sqe->addr = (uintptr_t)pending;
+		sqe->len = (length > INT32_MAX) ? INT32_MAX : (unsigned)length;
+		sqe->msg_flags = MSG_NOSIGNAL;
+		sqe->user_data = (uintptr_t)conn | OTP_OP_SEND;
+		conn->events |= OTP_IN_SEND;
+	}
+	else if(otpConnReadable(conn))
+	{
+		// readable but nowhere to put it: over a limit
+		size_t room = otpConnWindow(conn, &conn->window);
+		if(room == 0)
+		{
+			beginClose(ring, conn);
+			return;
+		}
+
+		struct io_uring_sqe* sqe = nextEntry(ring);
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = conn->fd;
+		sqe->addr = (uintptr_t)conn->window;
+		sqe->len = (room > INT32_MAX) ? INT32_MAX : (unsigned)room;
+		sqe->user_data = (uintptr_t)conn | OTP_OP_RECV;
+		conn->events |= OTP_IN_RECV;
+	}
+
+	// whatever just completed counts as progress
+	armDeadline(ring, conn);
+}
+
+// Starts closing: operations still in flight are ended by shutting the
+// socket down, and the connection is released when the last completes
+static void beginClose(struct otpUring* ring, struct otpConnection* conn)
+{
+	if(conn->events & OTP_CLOSING)
+		return;
+	conn->events |= OTP_CLOSING;
+	if(conn->events & (OTP_IN_RECV | OTP_IN_SEND))
+		shutdown(conn->fd, SHUT_RDWR);
+	else
+		finishClose(ring, conn);
+}
+
+// Closes the socket once nothing is in flight and keeps the connection's
+// buffers for the next client
+static void finishClose(struct otpUring* ring, struct otpConnection* conn)
+{
+	if(conn->events & (OTP_IN_RECV | OTP_IN_SEND))
+		return;
+
+	close(conn->fd);
+	otpConnRelease(conn);
+	otpTimerCancel(&ring->timers, &conn->deadline);
+	if(ring->metrics != NULL)
+		otpMetricSub(&ring->metrics->active, 1);
+
+	if(conn->prev != NULL)
+		conn->prev->next = conn->next;
+	else
+		ring->open = conn->next;
+	if(conn->next != NULL)
+		conn->next->prev = conn->prev;
+
+	if(ring->spareCount < OTP_URING_SPARE)
+	{
+		conn->next = ring->spare;
+		ring->spare = conn;
+		ring->spareCount++;
+	}
+	else
+	{
+		otpConnFree(conn);
+		free(conn);
+	}
+}
+
+// Restarts the deadline that applies to the connection now
+static void armDeadline(struct otpUring* ring, struct otpConnection* conn)
+{
+	unsigned int timeout = otpConnTimeout(conn);
+	if(timeout == 0)
+		otpTimerCancel(&ring->timers, &conn->deadline);
+	else
+		otpTimerSchedule(&ring->timers, &conn->deadline, ring->now + timeout);
+}
+
+// Starts closing every connection whose deadline has passed; what it
+// still has in flight is cut short
+static void expireConnections(struct otpUring* ring)
+{
+	struct otpTimer* due;
+	while((due = otpTimerExpire(&ring->timers, ring->now)) != NULL)
+	{
+		struct otpConnection* conn = (struct otpConnection*)((char*)due - offsetof(struct otpConnection, deadline));
+		if(ring->metrics != NULL)
+			otpMetricAdd(&ring->metrics->expired, 1);
+		beginClose(ring, conn);
+	}
+}